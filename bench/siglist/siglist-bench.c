@@ -0,0 +1,108 @@
+/*
+ * Times the signature lists of the dspam and crm114 backends, see
+ * siglist.h, for transactions of 10k and 100k training events or the given
+ * numbers. A quarter of the events repeat a signature of the transaction
+ * and a quarter of those cancel it out again, as mails moved to SPAM and
+ * back do. Each list is also merged into another one of the same size, as
+ * antispam_train_delay does with the transactions it batches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "lib.h"
+
+#include "siglist.h"
+
+#define SIGNATURE_LEN 24
+
+static const unsigned int default_events[] = { 10000, 100000 };
+
+static unsigned long long now_usecs(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+	i_fatal("gettimeofday() failed: %m");
+    return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static struct siglist *bench_fill(const char *const *sigs, unsigned int events)
+{
+    struct siglist *list = signature_list_create();
+    unsigned int i;
+
+    for (i = 0; i < events; i++)
+    {
+	if (i % 4 != 3)
+	    signature_list_append(list, sigs[i], TRUE);
+	else if (i % 16 != 15)
+	    signature_list_append(list, sigs[i / 2], TRUE);
+	else
+	    signature_list_append(list, sigs[i / 2], FALSE);
+    }
+
+    return list;
+}
+
+static void bench_run(unsigned int events)
+{
+    struct siglist *list, *other;
+    unsigned long long start, append_usecs, merge_usecs, free_usecs;
+    unsigned int i, count;
+    char **sigs;
+
+    // made up front, only the lists are timed
+    sigs = i_new(char *, events);
+    for (i = 0; i < events; i++)
+	sigs[i] = i_strdup_printf("%0*x", SIGNATURE_LEN, i * 2654435761U);
+
+    start = now_usecs();
+    list = bench_fill((const char *const *) sigs, events);
+    append_usecs = now_usecs() - start;
+    count = list->count;
+
+    other = bench_fill((const char *const *) sigs, events);
+    start = now_usecs();
+    signature_list_merge(other, list);
+    merge_usecs = now_usecs() - start;
+
+    start = now_usecs();
+    signature_list_free(&list);
+    signature_list_free(&other);
+    free_usecs = now_usecs() - start;
+
+    printf("%u events, %u signatures: append %llu usecs (%llu nsecs per "
+	    "event), merge %llu usecs, free %llu usecs\n", events, count,
+	    append_usecs, append_usecs * 1000 / events, merge_usecs,
+	    free_usecs);
+
+    for (i = 0; i < events; i++)
+	i_free(sigs[i]);
+    i_free(sigs);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int i, events;
+
+    lib_init();
+
+    if (argc == 1)
+    {
+	for (i = 0; i < N_ELEMENTS(default_events); i++)
+	    bench_run(default_events[i]);
+    }
+
+    for (i = 1; i < (unsigned int) argc; i++)
+    {
+	if (str_to_uint(argv[i], &events) < 0 || events == 0)
+	    i_fatal("usage: siglist-bench [<events> ...]");
+	bench_run(events);
+    }
+
+    lib_deinit();
+
+    return EXIT_SUCCESS;
+}
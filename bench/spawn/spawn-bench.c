@@ -0,0 +1,158 @@
+/*
+ * Compares the cost of starting a training program by forking the process
+ * itself with starting it through the spawn helper, see spawn-helper.h.
+ * The process first grows to the given size, as an imap process with its
+ * mailboxes open would, and then runs /bin/true the given number of times
+ * each way, printing the average time per run in microseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sysexits.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "lib.h"
+
+#include "spawn-helper.h"
+
+#define DEFAULT_RUNS 1000
+#define DEFAULT_SIZE_MB 256
+#define BENCH_BINARY "/bin/true"
+
+static const char *const bench_argv[] = { BENCH_BINARY, NULL };
+
+static unsigned long long now_usecs(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+	i_fatal("gettimeofday() failed: %m");
+    return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void bench_fork(unsigned int runs, int dnull)
+{
+    unsigned int i;
+    int status;
+    pid_t pid;
+
+    for (i = 0; i < runs; i++)
+    {
+	pid = fork();
+	if (pid < 0)
+	    i_fatal("fork() failed: %m");
+	if (pid == 0)
+	{
+	    if (dup2(dnull, 0) != 0 || dup2(dnull, 1) != 1
+		    || dup2(dnull, 2) != 2)
+		_exit(1);
+	    execv(BENCH_BINARY, (char *const *) bench_argv);
+	    _exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+	    i_fatal("waitpid() failed: %m");
+    }
+}
+
+static void bench_helper(unsigned int runs, int dnull)
+{
+    const int fds[3] = { dnull, dnull, dnull };
+    struct pollfd pfd;
+    unsigned int i, id, done;
+    int ret, status;
+
+    for (i = 0; i < runs; i++)
+    {
+	if (spawn_helper_spawn(BENCH_BINARY, bench_argv, fds) == 0)
+	    i_fatal("spawn_helper_spawn() failed");
+
+	// one at a time, like the fork() runs
+	for (done = 0; done == 0;)
+	{
+	    pfd.fd = spawn_helper_fd();
+	    pfd.events = POLLIN;
+	    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		i_fatal("poll() failed: %m");
+
+	    while ((ret = spawn_helper_read_status(&id, &status)) > 0)
+		done++;
+	    if (ret < 0)
+		i_fatal("the spawn helper is gone");
+	}
+    }
+}
+
+static void ATTR_NORETURN usage(void)
+{
+    fprintf(stderr, "usage: spawn-bench [-n <runs>] [-s <size in MB>]\n");
+    exit(EX_USAGE);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int runs = DEFAULT_RUNS, size_mb = DEFAULT_SIZE_MB;
+    unsigned long long start, fork_usecs, helper_usecs;
+    size_t size, pos;
+    char *mem;
+    int c, dnull;
+
+    lib_init();
+
+    while ((c = getopt(argc, argv, "n:s:")) > 0)
+    {
+	switch (c)
+	{
+	    case 'n':
+		if (str_to_uint(optarg, &runs) < 0 || runs == 0)
+		    usage();
+		break;
+	    case 's':
+		if (str_to_uint(optarg, &size_mb) < 0)
+		    usage();
+		break;
+	    default:
+		usage();
+	}
+    }
+
+    if (argc != optind)
+	usage();
+
+    dnull = open("/dev/null", O_RDWR);
+    if (dnull == -1)
+	i_fatal("open(/dev/null) failed: %m");
+
+    // started while small, as the plugin does
+    if (!spawn_helper_start("spawn-bench"))
+	i_fatal("failed to start the spawn helper");
+
+    // touched, so that fork() has the page tables to copy
+    size = (size_t) size_mb * 1024 * 1024;
+    mem = i_malloc(size);
+    for (pos = 0; pos < size; pos += 4096)
+	mem[pos] = 1;
+
+    start = now_usecs();
+    bench_fork(runs, dnull);
+    fork_usecs = now_usecs() - start;
+
+    start = now_usecs();
+    bench_helper(runs, dnull);
+    helper_usecs = now_usecs() - start;
+
+    printf("%u runs at %u MB\n", runs, size_mb);
+    printf("fork/exec:    %llu usecs per run\n", fork_usecs / runs);
+    printf("spawn helper: %llu usecs per run\n", helper_usecs / runs);
+
+    spawn_helper_stop();
+    i_free(mem);
+    close(dnull);
+    lib_deinit();
+
+    return EXIT_SUCCESS;
+}
@@ -5,6 +5,7 @@
 #include "user.h"
 #include "mailbox.h"
 #include "backends.h"
+#include "spawn-helper.h"
 
 static struct mail_storage_hooks antispam_plugin_hooks = {
     .mail_user_created = antispam_user_created,
@@ -21,6 +22,7 @@ void antispam_plugin_init(struct module *module)
 void antispam_plugin_deinit(void)
 {
     mail_storage_hooks_remove(&antispam_plugin_hooks);
+    spawn_helper_stop();
 }
 
 #ifdef DOVECOT_ABI_VERSION
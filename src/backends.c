@@ -16,21 +16,31 @@ void register_backends()
 {
     int index = 0;
 
-#define REG_BACKEND(name) \
+#define REG_BACKEND(name, ...) \
 	backends[index++] = (struct antispam_backend) { \
-		#name, \
-		name ## _init, \
-		name ## _transaction_begin, \
-		name ## _transaction_commit, \
-		name ## _transaction_rollback, \
-		name ## _handle_mail, \
+		.title = #name, \
+		.init = name ## _init, \
+		.transaction_begin = name ## _transaction_begin, \
+		.transaction_commit = name ## _transaction_commit, \
+		.transaction_rollback = name ## _transaction_rollback, \
+		.handle_mail = name ## _handle_mail, \
+		__VA_ARGS__ \
 	};
 
-    REG_BACKEND(mailtrain);
+    REG_BACKEND(mailtrain,
+	    .transaction_merge = mailtrain_transaction_merge);
     REG_BACKEND(spool2dir);
-    REG_BACKEND(signature_log);
-    REG_BACKEND(dspam);
-    REG_BACKEND(crm114);
+    REG_BACKEND(signature_log,
+	    .handle_mails = signature_log_handle_mails,
+	    .deinit = signature_log_deinit,
+	    .wanted_headers = signature_log_wanted_headers,
+	    .transaction_merge = signature_log_transaction_merge);
+    REG_BACKEND(dspam,
+	    .wanted_headers = dspam_wanted_headers,
+	    .transaction_merge = dspam_transaction_merge);
+    REG_BACKEND(crm114,
+	    .wanted_headers = crm114_wanted_headers,
+	    .transaction_merge = crm114_transaction_merge);
 
 #undef REG_BACKEND
 }
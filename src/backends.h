@@ -2,16 +2,43 @@
 #define ANTISPAM_BACKENDS_H
 
 #include "lib.h"
+#include "array.h"
 #include "mail-storage.h"
 #include "mail-storage-private.h"
 
 typedef bool(*init_fn_t) (struct mail_user *, void **);
-typedef void *(*transaction_begin_fn_t) (struct mailbox *,
+typedef void (*deinit_fn_t) (struct mail_user *, void *);
+typedef void *(*transaction_begin_fn_t) (struct mail_storage *,
 	enum mailbox_transaction_flags);
-typedef int (*transaction_commit_fn_t) (struct mailbox *, void *);
-typedef void (*transaction_rollback_fn_t) (struct mailbox *, void *);
+typedef int (*transaction_commit_fn_t) (struct mail_storage *, void *);
+typedef void (*transaction_rollback_fn_t) (struct mail_storage *, void *);
 typedef int (*handle_mail_fn_t) (struct mailbox_transaction_context *, void *,
 	struct mail *, bool);
+typedef const char *const *(*wanted_headers_fn_t) (void *);
+
+/*
+ * Moves the training of the committed transaction src into dst, which the
+ * batch keeps for later, and frees src so that the events of both net out
+ * against each other. Returns FALSE and leaves src alone if it has to be
+ * committed on its own.
+ */
+typedef bool (*transaction_merge_fn_t) (struct mail_storage *, void *dst,
+	void *src);
+
+struct antispam_mail_ref
+{
+    uint32_t uid;
+    bool spam;
+};
+ARRAY_DEFINE_TYPE(antispam_mail_ref, struct antispam_mail_ref);
+
+/*
+ * Trains all the mails copied from one mailbox in a transaction at once.
+ * The mail belongs to the source mailbox; mail_set_uid() on it with each
+ * uid gives the copied mails in order.
+ */
+typedef int (*handle_mails_fn_t) (struct mailbox_transaction_context *,
+	void *, struct mail *, const struct antispam_mail_ref *, unsigned int);
 
 struct antispam_backend
 {
@@ -21,6 +48,18 @@ struct antispam_backend
     transaction_commit_fn_t transaction_commit;
     transaction_rollback_fn_t transaction_rollback;
     handle_mail_fn_t handle_mail;
+    // optional, copies are passed to handle_mail one by one without it
+    handle_mails_fn_t handle_mails;
+    /*
+     * optional, releases what init and the transactions kept per user;
+     * also called without the user context set when the user is rejected
+     * after init succeeded
+     */
+    deinit_fn_t deinit;
+    // optional, the headers handle_mail(s) read, fetched together for it
+    wanted_headers_fn_t wanted_headers;
+    // optional, batched transactions are committed one by one without it
+    transaction_merge_fn_t transaction_merge;
 };
 
 void register_backends(void);
@@ -0,0 +1,107 @@
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+
+#include "batch.h"
+#include "user.h"
+
+bool antispam_batch_enabled(const struct antispam_user *asu)
+{
+    // without an ioloop nothing would ever flush the batch
+    return (asu->batch_commands || asu->train_delay > 0)
+	    && current_ioloop != NULL;
+}
+
+void antispam_batch_add(struct antispam_user *asu,
+	struct mail_storage *storage, void *data, unsigned int mails)
+{
+    struct antispam_batch *batch = &asu->batch;
+
+    if (batch->storage == NULL)
+    {
+	batch->storage = storage;
+	batch->data = data;
+
+	// a zero timeout fires as soon as the current command is done
+	batch->to = timeout_add(asu->train_delay * 1000,
+		antispam_batch_flush, asu);
+    }
+    else if (asu->backend->transaction_merge == NULL
+	    || !asu->backend->transaction_merge(storage, batch->data, data))
+    {
+	if (!array_is_created(&batch->parts))
+	    i_array_init(&batch->parts, 8);
+	array_append(&batch->parts, &data, 1);
+    }
+
+    batch->mails += mails;
+    if (asu->batch_max_mails > 0 && batch->mails >= asu->batch_max_mails)
+	antispam_batch_flush(asu);
+}
+
+void antispam_batch_add_ledger(struct antispam_user *asu, const char *guid,
+	bool spam)
+{
+    struct antispam_batch *batch = &asu->batch;
+    struct antispam_ledger_entry *entry;
+
+    if (batch->ledger_pool == NULL)
+    {
+	batch->ledger_pool = pool_alloconly_create("antispam batch ledger",
+		1024);
+	p_array_init(&batch->ledger, batch->ledger_pool, 16);
+    }
+
+    entry = array_append_space(&batch->ledger);
+    entry->guid = p_strdup(batch->ledger_pool, guid);
+    entry->spam = spam;
+}
+
+static void antispam_batch_record_ledger(struct antispam_user *asu)
+{
+    struct antispam_batch *batch = &asu->batch;
+    const struct antispam_ledger_entry *entry;
+
+    array_foreach(&batch->ledger, entry)
+	mmap_table_insert(asu->ledger, entry->guid, entry->spam ? 1 : 0);
+}
+
+void antispam_batch_flush(struct antispam_user *asu)
+{
+    struct antispam_batch *batch = &asu->batch;
+    struct mail_storage *storage = batch->storage;
+    void *const *part;
+    bool failed = FALSE;
+
+    if (batch->to != NULL)
+	timeout_remove(&batch->to);
+
+    if (storage == NULL)
+	return;
+
+    batch->storage = NULL;
+    batch->mails = 0;
+    if (asu->backend->transaction_commit(storage, batch->data) < 0)
+	failed = TRUE;
+    batch->data = NULL;
+
+    if (array_is_created(&batch->parts))
+    {
+	array_foreach(&batch->parts, part)
+	{
+	    if (asu->backend->transaction_commit(storage, *part) < 0)
+		failed = TRUE;
+	}
+	array_free(&batch->parts);
+    }
+
+    if (failed)
+	i_error("antispam: delayed training failed: %s",
+		mail_storage_get_last_error(storage, NULL));
+    else if (batch->ledger_pool != NULL)
+	antispam_batch_record_ledger(asu);
+
+    // a failed batch is retrained when its mails are copied again
+    if (batch->ledger_pool != NULL)
+	pool_unref(&batch->ledger_pool);
+}
@@ -0,0 +1,67 @@
+#ifndef ANTISPAM_BATCH_H
+#define ANTISPAM_BATCH_H
+
+#include "lib.h"
+#include "mail-storage.h"
+
+/*
+ * With antispam_batch or antispam_train_delay set, the backend transactions
+ * of a user's mailbox transactions are not committed along with them. Once
+ * its mailbox transaction is committed, each is handed to the batch of the
+ * user instead, which is committed when the ioloop runs next (i.e. once per
+ * IMAP command) or once the delay has passed since its first mail, when
+ * antispam_batch_max_mails mails have been added, or when the user logs
+ * out. A backend with transaction_merge folds them into one transaction, so
+ * that moving a mail back before then cancels its training in the backends
+ * that net their events (dspam, crm114, mailtrain, signature-log).
+ *
+ * A mailbox transaction that is rolled back rolls its backend transaction
+ * back as well, nothing of it ever reaches the batch. The copies a
+ * committed transaction adds to the ledger are only recorded there once
+ * the batch was trained successfully.
+ */
+
+struct antispam_user;
+
+struct antispam_ledger_entry
+{
+    const char *guid;
+    bool spam;
+};
+ARRAY_DEFINE_TYPE(antispam_ledger_entry, struct antispam_ledger_entry);
+
+ARRAY_DEFINE_TYPE(antispam_batch_part, void *);
+
+struct antispam_batch
+{
+    // the storage the batch reports its errors to, NULL if nothing is parked
+    struct mail_storage *storage;
+    void *data;
+    // backend transactions that couldn't be merged into data, in order
+    ARRAY_TYPE(antispam_batch_part) parts;
+
+    unsigned int mails;
+    struct timeout *to;
+
+    // ledger entries of the committed transactions, see antispam_copy()
+    pool_t ledger_pool;
+    ARRAY_TYPE(antispam_ledger_entry) ledger;
+};
+
+bool antispam_batch_enabled(const struct antispam_user *asu);
+
+/*
+ * Parks the backend transaction data of a committed mailbox transaction
+ * that trained the given number of mails.
+ */
+void antispam_batch_add(struct antispam_user *asu,
+	struct mail_storage *storage, void *data, unsigned int mails);
+
+/* Records the copy in the ledger if the batch is trained successfully. */
+void antispam_batch_add_ledger(struct antispam_user *asu, const char *guid,
+	bool spam);
+
+/* Commits the parked training now. */
+void antispam_batch_flush(struct antispam_user *asu);
+
+#endif
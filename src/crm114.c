@@ -21,14 +21,13 @@
 
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/wait.h>
-#include <fcntl.h>
 
 #include "lib.h"
 #include "mail-user.h"
 #include "mail-storage-private.h"
 
 #include "aux.h"
+#include "executor.h"
 #include "signature.h"
 #include "user.h"
 
@@ -43,88 +42,37 @@ struct crm114_config
     void *sig_data;
 };
 
-static int call_reaver(struct mail_storage *storage, const char *signature,
-	bool spam)
+static void crm114_callback(int status, const char *output ATTR_UNUSED,
+	void *context)
 {
-    struct antispam_user *asu = USER_CONTEXT(storage->user);
-    struct crm114_config *cfg = asu->backend_config;
-    int pipes[2];
-    pid_t pid;
-
-    /*
-     * For reaver stdin, it wants to read a full message but
-     * really only needs the signature.
-     */
-    if (pipe(pipes))
-	return -1;
+    bool *failed = context;
 
-    pid = fork();
-    if (pid < 0)
-	return -1;
+    if (status != 0)
+	*failed = TRUE;
+}
 
-    if (pid)
-    {
-	int status;
-	const char *signature_hdr = signature_header(cfg->sig_data);
-
-	close(pipes[0]);
-
-	// Reaver wants the mail but only needs the cache ID
-	write(pipes[1], signature_hdr, strlen(signature_hdr));
-	write(pipes[1], ": ", 2);
-	write(pipes[1], signature, strlen(signature));
-	write(pipes[1], "\r\n\r\n", 4);
-	close(pipes[1]);
-
-	/*
-	 * Wait for reaver
-	 */
-	waitpid(pid, &status, 0);
-	if (!WIFEXITED(status))
-	    return 1;
-
-	return WEXITSTATUS(status);
-    }
-    else
-    {
-	/* 2 fixed, extra args, terminating NULL */
-	int sz = sizeof(const char *) * (2 + cfg->args_num + 1);
-	const char **argv = i_malloc(sz);
-	int fd = open("/dev/null", O_RDONLY);
-	int i = 0;
-	int k = 0;
-
-	close(0);
-	close(1);
-	close(2);
-	/* see above */
-	close(pipes[1]);
-
-	if (dup2(pipes[0], 0) != 0)
-	    exit(1);
-	close(pipes[0]);
-
-	if (dup2(fd, 1) != 1)
-	    exit(1);
-	if (dup2(fd, 2) != 2)
-	    exit(1);
-	close(fd);
-
-	argv[i++] = cfg->binary;
-
-	for (k = 0; k < cfg->args_num; k++)
-	    argv[i++] = cfg->args[k];
-
-	argv[i++] = spam ? cfg->spam : cfg->non_spam;
-
-	execv(cfg->binary, (char *const *) argv);
-	/* fall through if reaver can't be found */
-	i_debug("executing %s failed: %d (uid=%d, gid=%d)", cfg->binary, errno,
-		getuid(), getgid());
-	exit(127);
-	/* not reached */
-	return -1;
-    }
+static int call_reaver(struct executor *executor, struct crm114_config *cfg,
+	const char *signature, bool spam, bool *failed)
+{
+    /* 2 fixed, extra args, terminating NULL */
+    const char **argv = t_new(const char *, 2 + cfg->args_num + 1);
+    const char *input;
+    int i = 0;
+    int k = 0;
+
+    argv[i++] = cfg->binary;
+
+    for (k = 0; k < cfg->args_num; k++)
+	argv[i++] = cfg->args[k];
+
+    argv[i++] = spam ? cfg->spam : cfg->non_spam;
+
+    // Reaver wants the mail but only needs the cache ID
+    input = t_strdup_printf("%s: %s\r\n\r\n",
+	    signature_header(cfg->sig_data), signature);
+
+    return executor_run(executor, cfg->binary, argv, -1, input,
+	    strlen(input), 0, crm114_callback, failed);
 }
 
 bool crm114_init(struct mail_user *user, void **data)
@@ -169,51 +117,87 @@ fail:
     return FALSE;
 }
 
+const char *const *crm114_wanted_headers(void *data)
+{
+    struct crm114_config *cfg = data;
+
+    return signature_wanted_headers(cfg->sig_data);
+}
+
 struct crm114_transaction_context
 {
     struct siglist *siglist;
 };
 
-void *crm114_transaction_begin(struct mailbox *box ATTR_UNUSED,
+void *crm114_transaction_begin(struct mail_storage *storage ATTR_UNUSED,
 	enum mailbox_transaction_flags flags ATTR_UNUSED)
 {
-    return i_new(struct crm114_transaction_context, 1);
+    struct crm114_transaction_context *ctc =
+	    i_new(struct crm114_transaction_context, 1);
+
+    ctc->siglist = signature_list_create();
+    return ctc;
 }
 
-int crm114_transaction_commit(struct mailbox *box, void *data)
+int crm114_transaction_commit(struct mail_storage *storage, void *data)
 {
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct crm114_config *cfg = asu->backend_config;
     struct crm114_transaction_context *ctc = data;
-    struct siglist *item;
+    struct siglist_item *item;
     int ret = 0;
 
     if (ctc == NULL)
     {
-	mail_storage_set_error(box->storage, MAIL_ERROR_NOTPOSSIBLE,
+	mail_storage_set_error(storage, MAIL_ERROR_NOTPOSSIBLE,
 		"Data allocation failed.");
 	return -1;
     }
 
-    item = ctc->siglist;
+    asu->stats.coalesced_events +=
+	    ctc->siglist->events - ctc->siglist->count;
+    signature_list_drop_trained(storage->user, ctc->siglist);
+    item = ctc->siglist->head;
 
-    while (item)
+    if (item != NULL)
     {
-	if (call_reaver(box->storage, item->sig, item->spam) != 0)
+	struct executor *executor = executor_init(asu->exec_concurrency,
+		asu->spawn_helper ? storage->user->username : NULL);
+	bool failed = FALSE;
+
+	while (item && !failed)
+	{
+	    T_BEGIN
+	    {
+		if (call_reaver(executor, cfg, item->sig, item->spam,
+			    &failed) != 0)
+		    failed = TRUE;
+	    }
+	    T_END;
+
+	    item = item->next;
+	}
+
+	executor_deinit(&executor);
+
+	if (failed)
 	{
 	    ret = -1;
-	    mail_storage_set_error(box->storage, MAIL_ERROR_NOTPOSSIBLE,
+	    mail_storage_set_error(storage, MAIL_ERROR_NOTPOSSIBLE,
 		    "Failed to call crm114 binary");
-	    break;
 	}
-
-	item = item->next;
     }
 
+    if (ret == 0)
+	signature_list_trained(storage->user, ctc->siglist);
+
     signature_list_free(&ctc->siglist);
     i_free(ctc);
     return ret;
 }
 
-void crm114_transaction_rollback(struct mailbox *box ATTR_UNUSED, void *data)
+void crm114_transaction_rollback(struct mail_storage *storage ATTR_UNUSED,
+	void *data)
 {
     struct crm114_transaction_context *ctc = data;
 
@@ -224,6 +208,20 @@ void crm114_transaction_rollback(struct mailbox *box ATTR_UNUSED, void *data)
     i_free(ctc);
 }
 
+bool crm114_transaction_merge(struct mail_storage *storage, void *dst,
+	void *src)
+{
+    struct crm114_transaction_context *dst_ctc = dst;
+    struct crm114_transaction_context *src_ctc = src;
+
+    if (dst_ctc == NULL || src_ctc == NULL)
+	return FALSE;
+
+    signature_list_merge(dst_ctc->siglist, src_ctc->siglist);
+    crm114_transaction_rollback(storage, src);
+    return TRUE;
+}
+
 int crm114_handle_mail(struct mailbox_transaction_context *t, void *data,
 	struct mail *mail, bool spam)
 {
@@ -247,6 +245,6 @@ int crm114_handle_mail(struct mailbox_transaction_context *t, void *data,
 	return -1;
     }
 
-    signature_list_append(&ctc->siglist, sig, spam);
+    signature_list_append(ctc->siglist, sig, spam);
     return 0;
 }
@@ -6,11 +6,14 @@
 #include "mail-storage-private.h"
 
 bool crm114_init(struct mail_user *user, void **data);
+const char *const *crm114_wanted_headers(void *data);
 
-void *crm114_transaction_begin(struct mailbox *box,
+void *crm114_transaction_begin(struct mail_storage *storage,
 	enum mailbox_transaction_flags flags);
-int crm114_transaction_commit(struct mailbox *box, void *data);
-void crm114_transaction_rollback(struct mailbox *box, void *data);
+int crm114_transaction_commit(struct mail_storage *storage, void *data);
+void crm114_transaction_rollback(struct mail_storage *storage, void *data);
+bool crm114_transaction_merge(struct mail_storage *storage, void *dst,
+	void *src);
 int crm114_handle_mail(struct mailbox_transaction_context *t, void *data,
 	struct mail *mail, bool spam);
 
@@ -21,15 +21,16 @@
 
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/wait.h>
-#include <fcntl.h>
 
 #include "lib.h"
+#include "str.h"
 #include "mail-user.h"
 #include "mail-storage-private.h"
 
 #include "aux.h"
+#include "executor.h"
 #include "signature.h"
+#include "smtp.h"
 #include "user.h"
 
 struct dspam_config
@@ -44,120 +45,149 @@ struct dspam_config
     const char *const *result_bl;
     unsigned int result_bl_num;
 
+    // dspam daemon mode
+    const char *socket;
+    const char *client_ident;
+    const char *user;
+
     void *sig_data;
+
+    // the signature and result headers, see dspam_wanted_headers()
+    const char **wanted;
 };
 
-static int call_dspam(struct mail_storage *storage, const char *sig, bool spam)
+static void dspam_callback(int status, const char *output, void *context)
 {
-    int pipes[2];
-    pid_t pid;
+    bool *failed = context;
 
     /*
-     * For dspam stderr; dspam seems to not always exit with a
-     * non-zero exit code on errors so we treat it as an error
-     * if it logged anything to stderr.
+     * dspam seems to not always exit with a non-zero exit code on errors
+     * so we treat it as an error if it logged anything to stderr.
      */
-    if (pipe(pipes) < 0)
-	return -1;
+    if (output != NULL)
+    {
+	i_debug("dspam error: %s\n", output);
+	*failed = TRUE;
+    }
 
-    pid = fork();
-    if (pid < 0)
-	return -1;
+    if (status != 0)
+	*failed = TRUE;
+}
 
-    if (pid)
-    {
-	int status;
-	char buf[1025];
-	int readsize;
-	bool error = FALSE;
+static int call_dspam(struct executor *executor, struct dspam_config *cfg,
+	const char *sig, bool spam, bool *failed)
+{
+    /* 2 fixed arg, extra args, terminating NULL */
+    const char **argv = t_new(const char *, 2 + cfg->args_num + 1);
+    int i = 0, k = 0;
 
-	close(pipes[1]);
+    argv[i++] = cfg->binary;
 
-	do
-	{
-	    readsize = read(pipes[0], buf, sizeof(buf) - 1);
-	    if (readsize < 0)
-	    {
-		readsize = -1;
-		if (errno == EINTR)
-		    readsize = -2;
-	    }
+    for (k = 0; k < cfg->args_num; k++)
+	if (strstr(cfg->args[k], "%s"))
+	    argv[i++] = t_strdup_printf(cfg->args[k], sig);
+	else
+	    argv[i++] = cfg->args[k];
 
-	    /*
-	     * readsize > 0 means that we read a message from
-	     * dspam, -1 means we failed to read for some odd
-	     * reason
-	     */
-	    if (readsize > 0 || readsize == -1)
-		error = TRUE;
+    argv[i++] = spam ? cfg->spam : cfg->non_spam;
 
-	    if (readsize > 0)
-	    {
-		buf[readsize] = '\0';
-		i_debug("dspam error: %s\n", buf);
-	    }
-	}
-	while (readsize == -2 || readsize > 0);
-
-	/*
-	 * Wait for dspam, should return instantly since we've
-	 * already waited above (waiting for stderr to close)
-	 */
-	waitpid(pid, &status, 0);
-	if (!WIFEXITED(status))
-	    error = TRUE;
-
-	close(pipes[0]);
-	if (error)
-	    return 1;
-	return WEXITSTATUS(status);
-    }
-    else
+    return executor_run(executor, cfg->binary, argv, -1, NULL, 0,
+	    EXECUTOR_FLAG_CAPTURE_OUTPUT, dspam_callback, failed);
+}
+
+static const char *dspam_process_mode(struct dspam_config *cfg,
+	const char *sig, bool spam)
+{
+    string_t *str = t_str_new(128);
+    unsigned int k;
+
+    str_append(str, "DSPAMPROCESSMODE=\"");
+
+    for (k = 0; k < cfg->args_num; k++)
     {
-	struct antispam_user *asu = USER_CONTEXT(storage->user);
-	struct dspam_config *cfg = asu->backend_config;
+	if (strstr(cfg->args[k], "%s"))
+	    str_printfa(str, cfg->args[k], sig);
+	else
+	    str_append(str, cfg->args[k]);
+	str_append_c(str, ' ');
+    }
+
+    str_append(str, spam ? cfg->spam : cfg->non_spam);
+    str_append_c(str, '"');
+
+    return str_c(str);
+}
 
-	/* 2 fixed arg, extra args, terminating NULL */
-	int sz = sizeof(const char *) * (2 + cfg->args_num + 1);
-	const char **argv = i_malloc(sz);
+/*
+ * Retrains all the signatures over a single DLMTP connection to the dspam
+ * daemon instead of running the dspam client once per signature. The
+ * requests are pipelined when the daemon allows it.
+ */
+static int dspam_call_daemon(struct mail_storage *storage,
+	const struct siglist *siglist)
+{
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct dspam_config *cfg = asu->backend_config;
+    const char *sig_hdr = signature_header(cfg->sig_data);
+    struct smtp_connection *conn;
+    const struct siglist_item *item;
+    unsigned int i;
+    int *results;
+    int ret = 0;
 
-	int fd = open("/dev/null", O_RDONLY);
-	int i = 0, k = 0;
+    if (siglist->count == 0)
+	return 0;
 
-	close(0);
-	close(1);
-	close(2);
-	/* see above */
-	close(pipes[0]);
+    conn = smtp_connect(cfg->socket, TRUE);
+    if (conn == NULL)
+	return -1;
 
-	if (dup2(pipes[1], 2) != 2)
-	    exit(1);
-	if (dup2(pipes[1], 1) != 1)
-	    exit(1);
-	close(pipes[1]);
+    results = i_new(int, siglist->count);
 
-	if (dup2(fd, 0) != 0)
-	    exit(1);
-	close(fd);
+    for (i = 0, item = siglist->head; item != NULL; i++, item = item->next)
+    {
+	T_BEGIN
+	{
+	    const char *mode = dspam_process_mode(cfg, item->sig, item->spam);
 
-	argv[i++] = cfg->binary;
+	    ret = smtp_message_begin(conn, cfg->client_ident, mode,
+		    cfg->user);
+	    if (ret == 0)
+	    {
+		// the daemon only needs the signature, not the mail
+		const char *body = t_strdup_printf("%s: %s\n\n", sig_hdr,
+			item->sig);
 
-	for (k = 0; k < cfg->args_num; k++)
-	    if (strstr(cfg->args[k], "%s"))
-		argv[i++] = t_strdup_printf(cfg->args[k], sig);
+		smtp_message_data(conn, body, strlen(body));
+		ret = smtp_message_end(conn, &results[i]);
+	    }
 	    else
-		argv[i++] = cfg->args[k];
+		results[i] = -1;
+	}
+	T_END;
 
-	argv[i++] = spam ? cfg->spam : cfg->non_spam;
+	if (ret == -2)
+	    break;
+    }
 
-	execv(cfg->binary, (char * const *) argv);
-	i_debug("executing %s failed: %d (uid=%d, gid=%d)", cfg->binary, errno,
-		getuid(), getgid());
-	/* fall through if dspam can't be found */
-	exit(127);
-	/* not reached */
-	return -1;
+    if (smtp_disconnect(&conn) < 0)
+	ret = -2;
+
+    if (ret != -2)
+    {
+	for (i = 0, item = siglist->head; item != NULL; i++, item = item->next)
+	{
+	    if (results[i] / 100 != 2)
+	    {
+		i_debug("dspam daemon failed to retrain signature %s",
+			item->sig);
+		ret = -1;
+	    }
+	}
     }
+
+    i_free(results);
+    return ret < 0 ? -1 : 0;
 }
 
 bool dspam_init(struct mail_user *user, void **data)
@@ -187,6 +217,20 @@ bool dspam_init(struct mail_user *user, void **data)
     if (EMPTY_STR(cfg->non_spam))
 	cfg->non_spam = "--class=innocent";
 
+    cfg->socket = config(user, "dspam_socket");
+    if (!EMPTY_STR(cfg->socket))
+    {
+	cfg->client_ident = config(user, "dspam_client_ident");
+	if (cfg->client_ident == NULL)
+	    cfg->client_ident = "";
+
+	cfg->user = config(user, "dspam_user");
+	if (EMPTY_STR(cfg->user))
+	    cfg->user = user->username;
+    }
+    else
+	cfg->socket = NULL;
+
     cfg->result_hdr = config(user, "dspam_result_header");
     if (!EMPTY_STR(cfg->result_hdr))
     {
@@ -206,6 +250,10 @@ bool dspam_init(struct mail_user *user, void **data)
 	goto fail;
     }
 
+    cfg->wanted = p_new(user->pool, const char *, 3);
+    cfg->wanted[0] = signature_header(cfg->sig_data);
+    cfg->wanted[1] = EMPTY_STR(cfg->result_hdr) ? NULL : cfg->result_hdr;
+
     *data = cfg;
     return TRUE;
 
@@ -214,51 +262,99 @@ fail:
     return FALSE;
 }
 
+const char *const *dspam_wanted_headers(void *data)
+{
+    struct dspam_config *cfg = data;
+
+    return cfg->wanted;
+}
+
 struct dspam_transaction_context
 {
     struct siglist *siglist;
 };
 
-void *dspam_transaction_begin(struct mailbox *box ATTR_UNUSED,
+void *dspam_transaction_begin(struct mail_storage *storage ATTR_UNUSED,
 	enum mailbox_transaction_flags flags ATTR_UNUSED)
 {
-    return i_new(struct dspam_transaction_context, 1);
+    struct dspam_transaction_context *dtc =
+	    i_new(struct dspam_transaction_context, 1);
+
+    dtc->siglist = signature_list_create();
+    return dtc;
 }
 
-int dspam_transaction_commit(struct mailbox *box, void *data)
+int dspam_transaction_commit(struct mail_storage *storage, void *data)
 {
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct dspam_config *cfg = asu->backend_config;
     struct dspam_transaction_context *dtc = data;
-    struct siglist *item;
+    struct siglist_item *item;
     int ret = 0;
 
     if (dtc == NULL)
     {
-	mail_storage_set_error(box->storage, MAIL_ERROR_NOTPOSSIBLE,
+	mail_storage_set_error(storage, MAIL_ERROR_NOTPOSSIBLE,
 		"Data allocation failed.");
 	return -1;
     }
 
-    item = dtc->siglist;
+    asu->stats.coalesced_events +=
+	    dtc->siglist->events - dtc->siglist->count;
+    signature_list_drop_trained(storage->user, dtc->siglist);
+    item = dtc->siglist->head;
 
-    while (item)
+    if (cfg->socket != NULL)
     {
-	if (call_dspam(box->storage, item->sig, item->spam) != 0)
+	if (dspam_call_daemon(storage, dtc->siglist) != 0)
 	{
 	    ret = -1;
-	    mail_storage_set_error(box->storage, MAIL_ERROR_NOTPOSSIBLE,
+	    mail_storage_set_error(storage, MAIL_ERROR_NOTPOSSIBLE,
 		    "Failed to call dspam");
-	    break;
 	}
 
-	item = item->next;
+	item = NULL;
     }
 
+    if (item != NULL)
+    {
+	struct executor *executor = executor_init(asu->exec_concurrency,
+		asu->spawn_helper ? storage->user->username : NULL);
+	bool failed = FALSE;
+
+	while (item && !failed)
+	{
+	    T_BEGIN
+	    {
+		if (call_dspam(executor, cfg, item->sig, item->spam,
+			    &failed) != 0)
+		    failed = TRUE;
+	    }
+	    T_END;
+
+	    item = item->next;
+	}
+
+	executor_deinit(&executor);
+
+	if (failed)
+	{
+	    ret = -1;
+	    mail_storage_set_error(storage, MAIL_ERROR_NOTPOSSIBLE,
+		    "Failed to call dspam");
+	}
+    }
+
+    if (ret == 0)
+	signature_list_trained(storage->user, dtc->siglist);
+
     signature_list_free(&dtc->siglist);
     i_free(dtc);
     return ret;
 }
 
-void dspam_transaction_rollback(struct mailbox *box ATTR_UNUSED, void *data)
+void dspam_transaction_rollback(struct mail_storage *storage ATTR_UNUSED,
+	void *data)
 {
     struct dspam_transaction_context *dtc = data;
 
@@ -269,6 +365,20 @@ void dspam_transaction_rollback(struct mailbox *box ATTR_UNUSED, void *data)
     i_free(dtc);
 }
 
+bool dspam_transaction_merge(struct mail_storage *storage, void *dst,
+	void *src)
+{
+    struct dspam_transaction_context *dst_dtc = dst;
+    struct dspam_transaction_context *src_dtc = src;
+
+    if (dst_dtc == NULL || src_dtc == NULL)
+	return FALSE;
+
+    signature_list_merge(dst_dtc->siglist, src_dtc->siglist);
+    dspam_transaction_rollback(storage, src);
+    return TRUE;
+}
+
 int dspam_handle_mail(struct mailbox_transaction_context *t, void *data,
 	struct mail *mail, bool spam)
 {
@@ -308,6 +418,6 @@ int dspam_handle_mail(struct mailbox_transaction_context *t, void *data,
 	return -1;
     }
 
-    signature_list_append(&dtc->siglist, sig, spam);
+    signature_list_append(dtc->siglist, sig, spam);
     return 0;
 }
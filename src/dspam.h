@@ -6,11 +6,14 @@
 #include "mail-storage-private.h"
 
 bool dspam_init(struct mail_user *user, void **data);
+const char *const *dspam_wanted_headers(void *data);
 
-void *dspam_transaction_begin(struct mailbox *box,
+void *dspam_transaction_begin(struct mail_storage *storage,
 	enum mailbox_transaction_flags flags);
-int dspam_transaction_commit(struct mailbox *box, void *data);
-void dspam_transaction_rollback(struct mailbox *box, void *data);
+int dspam_transaction_commit(struct mail_storage *storage, void *data);
+void dspam_transaction_rollback(struct mail_storage *storage, void *data);
+bool dspam_transaction_merge(struct mail_storage *storage, void *dst,
+	void *src);
 int dspam_handle_mail(struct mailbox_transaction_context *t, void *data,
 	struct mail *mail, bool spam);
 
@@ -0,0 +1,443 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "fd-close-on-exec.h"
+
+#include "executor.h"
+#include "spawn-helper.h"
+
+// how much of the child output is kept for the callback
+#define EXECUTOR_MAX_OUTPUT 1024
+// exit polling interval if pidfds aren't available
+#define EXECUTOR_POLL_MSECS 10
+
+struct executor_job
+{
+    pid_t pid;
+    int pidfd;
+    unsigned int helper_id;	// non-zero if run by the spawn helper
+
+    int in_fd;
+    unsigned char *input;
+    size_t input_size, input_pos;
+
+    int out_fd;
+    string_t *output;
+
+    bool exited;
+    int status;
+
+    executor_callback_t *callback;
+    void *context;
+};
+
+ARRAY_DEFINE_TYPE(executor_job, struct executor_job *);
+
+struct executor
+{
+    unsigned int max_children;
+    const char *helper_owner;	// NULL to fork the children here
+    ARRAY_TYPE(executor_job) jobs;
+};
+
+static int executor_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (fd != -1)
+	fd_close_on_exec(fd, TRUE);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static void executor_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags != -1)
+	(void) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void executor_close(int *fd)
+{
+    if (*fd != -1)
+    {
+	close(*fd);
+	*fd = -1;
+    }
+}
+
+static void executor_write_input(struct executor_job *job)
+{
+    ssize_t ret;
+
+    ret = write(job->in_fd, job->input + job->input_pos,
+	    job->input_size - job->input_pos);
+    if (ret < 0)
+    {
+	if (errno == EAGAIN || errno == EINTR)
+	    return;
+	// the child doesn't want the rest (EPIPE), which isn't our problem
+	job->input_pos = job->input_size;
+    }
+    else
+	job->input_pos += ret;
+
+    if (job->input_pos == job->input_size)
+	executor_close(&job->in_fd);
+}
+
+static void executor_read_output(struct executor_job *job)
+{
+    char buf[1024];
+    ssize_t ret;
+
+    for (;;)
+    {
+	ret = read(job->out_fd, buf, sizeof(buf));
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret < 0 && errno == EAGAIN)
+	    return;
+	if (ret <= 0)
+	    break;
+
+	if (str_len(job->output) < EXECUTOR_MAX_OUTPUT)
+	    str_append_n(job->output, buf,
+		    I_MIN((size_t) ret,
+			    EXECUTOR_MAX_OUTPUT - str_len(job->output)));
+    }
+
+    executor_close(&job->out_fd);
+}
+
+static void executor_check_exit(struct executor_job *job)
+{
+    int status;
+
+    if (waitpid(job->pid, &status, WNOHANG) != job->pid)
+	return;
+
+    job->exited = TRUE;
+    job->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    executor_close(&job->pidfd);
+}
+
+static void executor_read_helper_status(struct executor_job *const *jobs,
+	unsigned int count)
+{
+    unsigned int i, id;
+    int ret, status;
+
+    while ((ret = spawn_helper_read_status(&id, &status)) > 0)
+    {
+	for (i = 0; i < count; i++)
+	{
+	    if (jobs[i]->helper_id == id && !jobs[i]->exited)
+	    {
+		jobs[i]->exited = TRUE;
+		jobs[i]->status = status;
+		break;
+	    }
+	}
+    }
+
+    if (ret < 0)
+    {
+	// the helper died, its children can't be waited for anymore
+	for (i = 0; i < count; i++)
+	{
+	    if (jobs[i]->helper_id != 0 && !jobs[i]->exited)
+	    {
+		jobs[i]->exited = TRUE;
+		jobs[i]->status = -1;
+	    }
+	}
+    }
+}
+
+static void executor_job_finish(struct executor_job *job)
+{
+    const char *output = NULL;
+
+    if (job->output != NULL && str_len(job->output) > 0)
+	output = str_c(job->output);
+
+    if (job->callback != NULL)
+	job->callback(job->status, output, job->context);
+
+    if (job->output != NULL)
+	str_free(&job->output);
+    i_free(job->input);
+    i_free(job);
+}
+
+/* Waits until at least one of the running children has been reaped. */
+static void executor_wait_one(struct executor *executor)
+{
+    struct executor_job *const *jobs;
+    struct pollfd *pfd;
+    unsigned int i, n, count;
+    bool finished = FALSE;
+    bool helper_jobs;
+    int timeout;
+
+    jobs = array_get(&executor->jobs, &count);
+    if (count == 0)
+	return;
+
+    pfd = i_new(struct pollfd, count * 3 + 1);
+
+    while (!finished)
+    {
+	n = 0;
+	timeout = -1;
+	helper_jobs = FALSE;
+
+	for (i = 0; i < count; i++)
+	{
+	    if (jobs[i]->in_fd != -1)
+	    {
+		pfd[n].fd = jobs[i]->in_fd;
+		pfd[n++].events = POLLOUT;
+	    }
+	    if (jobs[i]->out_fd != -1)
+	    {
+		pfd[n].fd = jobs[i]->out_fd;
+		pfd[n++].events = POLLIN;
+	    }
+	    if (jobs[i]->pidfd != -1)
+	    {
+		pfd[n].fd = jobs[i]->pidfd;
+		pfd[n++].events = POLLIN;
+	    }
+	    else if (jobs[i]->helper_id != 0)
+		helper_jobs = helper_jobs || !jobs[i]->exited;
+	    else if (!jobs[i]->exited)
+		timeout = EXECUTOR_POLL_MSECS;
+	}
+
+	if (helper_jobs && spawn_helper_fd() != -1)
+	{
+	    pfd[n].fd = spawn_helper_fd();
+	    pfd[n++].events = POLLIN;
+	}
+
+	if (n > 0 && poll(pfd, n, timeout) < 0 && errno != EINTR)
+	{
+	    /*
+	     * Nothing will change by polling again, give the running
+	     * children up like those of a helper that died.
+	     */
+	    i_error("antispam: poll() failed: %m");
+	    for (i = 0; i < count; i++)
+	    {
+		if (!jobs[i]->exited && jobs[i]->helper_id == 0)
+		    executor_check_exit(jobs[i]);
+		if (!jobs[i]->exited)
+		{
+		    jobs[i]->exited = TRUE;
+		    jobs[i]->status = -1;
+		    executor_close(&jobs[i]->pidfd);
+		}
+	    }
+	}
+	else if (n == 0)
+	    usleep(EXECUTOR_POLL_MSECS * 1000);
+
+	if (helper_jobs)
+	    executor_read_helper_status(jobs, count);
+
+	for (i = 0; i < count; i++)
+	{
+	    struct executor_job *job = jobs[i];
+
+	    if (job->in_fd != -1)
+		executor_write_input(job);
+	    if (job->out_fd != -1)
+		executor_read_output(job);
+	    if (!job->exited && job->helper_id == 0)
+		executor_check_exit(job);
+
+	    if (job->exited)
+	    {
+		// a leftover grandchild mustn't keep us waiting
+		executor_close(&job->in_fd);
+		if (job->out_fd != -1)
+		    executor_read_output(job);
+		executor_close(&job->out_fd);
+		finished = TRUE;
+	    }
+	}
+    }
+
+    i_free(pfd);
+
+    for (i = 0; i < count;)
+    {
+	if (jobs[i]->exited)
+	{
+	    executor_job_finish(jobs[i]);
+	    array_delete(&executor->jobs, i, 1);
+	    jobs = array_get(&executor->jobs, &count);
+	}
+	else
+	    i++;
+    }
+}
+
+struct executor *executor_init(unsigned int max_children,
+	const char *helper_owner)
+{
+    struct executor *executor = i_new(struct executor, 1);
+
+    executor->max_children = max_children == 0 ? 1 : max_children;
+    executor->helper_owner = helper_owner;
+    i_array_init(&executor->jobs, executor->max_children);
+
+    return executor;
+}
+
+int executor_run(struct executor *executor, const char *binary,
+	const char *const *argv, int stdin_fd, const void *input,
+	size_t input_size, enum executor_flags flags,
+	executor_callback_t *callback, void *context)
+{
+    struct executor_job *job;
+    int in_pipe[2] = { -1, -1 };
+    int out_pipe[2] = { -1, -1 };
+    unsigned int helper_id = 0;
+    pid_t pid;
+
+    while (array_count(&executor->jobs) >= executor->max_children)
+	executor_wait_one(executor);
+
+    if ((stdin_fd == -1 && input != NULL && pipe(in_pipe) < 0)
+	    || ((flags & EXECUTOR_FLAG_CAPTURE_OUTPUT) != 0
+		    && pipe(out_pipe) < 0))
+    {
+	i_error("antispam: pipe() failed: %m");
+	executor_close(&in_pipe[0]);
+	executor_close(&in_pipe[1]);
+	executor_close(&out_pipe[0]);
+	executor_close(&out_pipe[1]);
+	return -1;
+    }
+
+    // only the dup2()ed copies may survive in the child
+    if (in_pipe[0] != -1)
+    {
+	fd_close_on_exec(in_pipe[0], TRUE);
+	fd_close_on_exec(in_pipe[1], TRUE);
+    }
+    if (out_pipe[0] != -1)
+    {
+	fd_close_on_exec(out_pipe[0], TRUE);
+	fd_close_on_exec(out_pipe[1], TRUE);
+    }
+
+    if (executor->helper_owner != NULL
+	    && spawn_helper_running(executor->helper_owner))
+    {
+	int dnull = open("/dev/null", O_RDWR);
+	int fds[3];
+
+	fds[0] = stdin_fd != -1 ? stdin_fd
+		: in_pipe[0] != -1 ? in_pipe[0] : dnull;
+	fds[1] = fds[2] = out_pipe[1] != -1 ? out_pipe[1] : dnull;
+
+	helper_id = dnull == -1 ? 0 : spawn_helper_spawn(binary, argv, fds);
+	if (dnull != -1)
+	    close(dnull);
+    }
+
+    if (helper_id != 0)
+	pid = -1;
+    else if ((pid = fork()) < 0)
+    {
+	i_error("antispam: fork() failed: %m");
+	executor_close(&in_pipe[0]);
+	executor_close(&in_pipe[1]);
+	executor_close(&out_pipe[0]);
+	executor_close(&out_pipe[1]);
+	return -1;
+    }
+
+    if (pid == 0)
+    {
+	int dnull = open("/dev/null", O_RDWR);
+
+	if (stdin_fd == -1)
+	    stdin_fd = in_pipe[0] != -1 ? in_pipe[0] : dnull;
+
+	if (dup2(stdin_fd, 0) != 0)
+	    _exit(1);
+	if (dup2(out_pipe[1] != -1 ? out_pipe[1] : dnull, 1) != 1)
+	    _exit(1);
+	if (dup2(out_pipe[1] != -1 ? out_pipe[1] : dnull, 2) != 2)
+	    _exit(1);
+
+	execv(binary, (char *const *) argv);
+	i_debug("executing %s failed: %d (uid=%d, gid=%d)", binary, errno,
+		getuid(), getgid());
+	/* fall through if the binary can't be found */
+	_exit(127);
+    }
+
+    job = i_new(struct executor_job, 1);
+    job->pid = pid;
+    job->helper_id = helper_id;
+    job->pidfd = helper_id != 0 ? -1 : executor_pidfd_open(pid);
+    job->callback = callback;
+    job->context = context;
+
+    job->in_fd = in_pipe[1];
+    executor_close(&in_pipe[0]);
+    if (job->in_fd != -1)
+    {
+	job->input = i_malloc(input_size);
+	memcpy(job->input, input, input_size);
+	job->input_size = input_size;
+	executor_set_nonblock(job->in_fd);
+	if (input_size == 0)
+	    executor_close(&job->in_fd);
+    }
+
+    job->out_fd = out_pipe[0];
+    executor_close(&out_pipe[1]);
+    if (job->out_fd != -1)
+    {
+	job->output = str_new(default_pool, 128);
+	executor_set_nonblock(job->out_fd);
+    }
+
+    array_append(&executor->jobs, &job, 1);
+    return 0;
+}
+
+void executor_wait(struct executor *executor)
+{
+    while (array_count(&executor->jobs) > 0)
+	executor_wait_one(executor);
+}
+
+void executor_deinit(struct executor **_executor)
+{
+    struct executor *executor = *_executor;
+
+    *_executor = NULL;
+
+    executor_wait(executor);
+    array_free(&executor->jobs);
+    i_free(executor);
+}
@@ -0,0 +1,54 @@
+#ifndef ANTISPAM_EXECUTOR_H
+#define ANTISPAM_EXECUTOR_H
+
+#include "lib.h"
+
+/*
+ * Runs the training binaries of the exec based backends, keeping up to a
+ * configured number of them running at the same time. The stdin data is
+ * written and the output drained without blocking while the children run.
+ */
+
+struct executor;
+
+enum executor_flags
+{
+    // collect stdout and stderr instead of sending them to /dev/null
+    EXECUTOR_FLAG_CAPTURE_OUTPUT = 0x01
+};
+
+/*
+ * Called when the child is reaped. status is the exit code of the child,
+ * or -1 if it couldn't be started or didn't exit normally. output is the
+ * beginning of what it printed, or NULL if it printed nothing or the
+ * output wasn't captured.
+ */
+typedef void executor_callback_t(int status, const char *output,
+	void *context);
+
+/*
+ * If helper_owner isn't NULL and the spawn helper is running for that
+ * user, the children are forked by it rather than by this process.
+ */
+struct executor *executor_init(unsigned int max_children,
+	const char *helper_owner);
+
+/*
+ * Starts binary with the NULL-terminated argv. The child reads stdin from
+ * stdin_fd if it isn't -1, from input if it isn't NULL, or from /dev/null
+ * otherwise. Blocks while the maximum number of children is running.
+ * Returns -1 if the child couldn't be started, the callback isn't called
+ * then.
+ */
+int executor_run(struct executor *executor, const char *binary,
+	const char *const *argv, int stdin_fd, const void *input,
+	size_t input_size, enum executor_flags flags,
+	executor_callback_t *callback, void *context);
+
+/* Waits for all the running children. */
+void executor_wait(struct executor *executor);
+
+/* Waits for all the running children and frees the executor. */
+void executor_deinit(struct executor **executor);
+
+#endif
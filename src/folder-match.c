@@ -0,0 +1,161 @@
+#include "lib.h"
+
+#include "folder-match.h"
+#include "strmap.h"
+
+struct folder_trie_node
+{
+    struct folder_trie_node *children;
+    struct folder_trie_node *next;	// sibling
+    enum mailbox_class box_class;	// CLASS_OTHER if no pattern ends here
+    unsigned char c;
+};
+
+struct folder_matcher
+{
+    pool_t pool;
+    struct strmap *exact;
+    struct folder_trie_node prefix;
+    struct folder_trie_node iprefix;
+    unsigned int classes;	// bit mask of the classes that can match
+};
+
+static unsigned int class_rank(enum mailbox_class box_class)
+{
+    switch (box_class)
+    {
+	case CLASS_SPAM:
+	    return 3;
+	case CLASS_TRASH:
+	    return 2;
+	case CLASS_UNSURE:
+	    return 1;
+	case CLASS_OTHER:
+	    break;
+    }
+
+    return 0;
+}
+
+static enum mailbox_class class_max(enum mailbox_class a,
+	enum mailbox_class b)
+{
+    return class_rank(a) >= class_rank(b) ? a : b;
+}
+
+static struct folder_trie_node *trie_child(const struct folder_trie_node
+	*node, unsigned char c)
+{
+    struct folder_trie_node *child;
+
+    for (child = node->children; child != NULL; child = child->next)
+	if (child->c == c)
+	    return child;
+
+    return NULL;
+}
+
+static void trie_add(pool_t pool, struct folder_trie_node *node,
+	const char *prefix, size_t len, bool fold,
+	enum mailbox_class box_class)
+{
+    struct folder_trie_node *child;
+    unsigned char c;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+	c = fold ? i_tolower(prefix[i]) : (unsigned char) prefix[i];
+	child = trie_child(node, c);
+	if (child == NULL)
+	{
+	    child = p_new(pool, struct folder_trie_node, 1);
+	    child->c = c;
+	    child->next = node->children;
+	    node->children = child;
+	}
+	node = child;
+    }
+
+    node->box_class = class_max(node->box_class, box_class);
+}
+
+static enum mailbox_class trie_match(const struct folder_trie_node *node,
+	const char *name, bool fold)
+{
+    enum mailbox_class ret = node->box_class;
+    unsigned char c;
+
+    for (; *name != '\0' && node != NULL; name++)
+    {
+	c = fold ? i_tolower(*name) : (unsigned char) *name;
+	node = trie_child(node, c);
+	if (node != NULL)
+	    ret = class_max(ret, node->box_class);
+    }
+
+    return ret;
+}
+
+struct folder_matcher *folder_matcher_create(pool_t pool)
+{
+    struct folder_matcher *matcher = p_new(pool, struct folder_matcher, 1);
+
+    matcher->pool = pool;
+    matcher->exact = strmap_create(pool, 16);
+
+    return matcher;
+}
+
+void folder_matcher_add(struct folder_matcher *matcher,
+	enum folder_match_type type, const char *pattern,
+	enum mailbox_class box_class)
+{
+    size_t len = strlen(pattern);
+    void *value;
+
+    switch (type)
+    {
+	case FMT_EXACT:
+	    if (len == 0)
+		break;
+	    matcher->classes |= 1 << box_class;
+	    if (strmap_lookup(matcher->exact, pattern, &value))
+		box_class = class_max(POINTER_CAST_TO(value, unsigned int),
+			box_class);
+	    strmap_insert(matcher->exact, pattern, POINTER_CAST(box_class));
+	    break;
+	case FMT_PATTERN:
+	case FMT_PATTERN_IGNORE_CASE:
+	    if (len == 0)
+		break;
+	    matcher->classes |= 1 << box_class;
+	    if (pattern[len - 1] == '*')
+		len--;
+	    trie_add(matcher->pool, type == FMT_PATTERN ? &matcher->prefix
+		    : &matcher->iprefix, pattern, len,
+		    type == FMT_PATTERN_IGNORE_CASE, box_class);
+	    break;
+    }
+}
+
+bool folder_matcher_has_class(const struct folder_matcher *matcher,
+	enum mailbox_class box_class)
+{
+    return (matcher->classes & (1 << box_class)) != 0;
+}
+
+enum mailbox_class folder_matcher_classify(const struct folder_matcher
+	*matcher, const char *name)
+{
+    enum mailbox_class ret;
+    void *value;
+
+    ret = trie_match(&matcher->prefix, name, FALSE);
+    ret = class_max(ret, trie_match(&matcher->iprefix, name, TRUE));
+
+    if (strmap_lookup(matcher->exact, name, &value))
+	ret = class_max(ret, POINTER_CAST_TO(value, unsigned int));
+
+    return ret;
+}
@@ -0,0 +1,45 @@
+#ifndef ANTISPAM_FOLDER_MATCH_H
+#define ANTISPAM_FOLDER_MATCH_H
+
+#include "lib.h"
+#include "mailbox.h"
+
+/*
+ * All the folder names and patterns of a user compiled into one lookup
+ * structure: a hash for the exact names and two tries (case-sensitive
+ * and case-folded) for the patterns. Classifying a mailbox name walks it
+ * once and doesn't allocate.
+ */
+
+enum folder_match_type
+{
+    FMT_EXACT,
+    FMT_PATTERN,
+    FMT_PATTERN_IGNORE_CASE
+};
+
+struct folder_matcher;
+
+struct folder_matcher *folder_matcher_create(pool_t pool);
+
+/*
+ * Adds one configured name or pattern. A pattern matches every name it
+ * is a prefix of, with an optional '*' at the end. Empty names and
+ * patterns match nothing.
+ */
+void folder_matcher_add(struct folder_matcher *matcher,
+	enum folder_match_type type, const char *pattern,
+	enum mailbox_class box_class);
+
+/* Returns TRUE if any name can be classified as box_class. */
+bool folder_matcher_has_class(const struct folder_matcher *matcher,
+	enum mailbox_class box_class);
+
+/*
+ * Returns the class of the mailbox name. If several classes match, spam
+ * wins over trash and trash over unsure.
+ */
+enum mailbox_class folder_matcher_classify(const struct folder_matcher
+	*matcher, const char *name);
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdint.h>
+#include <lmdb.h>
+
+#include "lib.h"
+
+#include "lmdb-store.h"
+
+struct lmdb_store
+{
+    char *path;
+    MDB_env *env;
+    MDB_dbi dbi;
+    MDB_txn *txn;		// the write transaction, if any
+};
+
+static void lmdb_store_error(struct lmdb_store *store, const char *func,
+	int ret)
+{
+    i_error("antispam: %s(%s) failed: %s", func, store->path,
+	    mdb_strerror(ret));
+}
+
+struct lmdb_store *lmdb_store_open(const char *path, size_t map_size)
+{
+    struct lmdb_store *store = i_new(struct lmdb_store, 1);
+    MDB_txn *txn;
+    int ret, dead;
+
+    store->path = i_strdup(path);
+
+    if ((ret = mdb_env_create(&store->env)) != 0)
+    {
+	lmdb_store_error(store, "mdb_env_create", ret);
+	store->env = NULL;
+	goto fail;
+    }
+
+    if ((ret = mdb_env_set_mapsize(store->env, map_size)) != 0)
+    {
+	lmdb_store_error(store, "mdb_env_set_mapsize", ret);
+	goto fail;
+    }
+
+    // a single file instead of a directory, shared by the processes
+    if ((ret = mdb_env_open(store->env, path, MDB_NOSUBDIR, 0600)) != 0)
+    {
+	lmdb_store_error(store, "mdb_env_open", ret);
+	goto fail;
+    }
+
+    // clear the reader slots of crashed processes
+    (void) mdb_reader_check(store->env, &dead);
+
+    if ((ret = mdb_txn_begin(store->env, NULL, 0, &txn)) != 0)
+    {
+	lmdb_store_error(store, "mdb_txn_begin", ret);
+	goto fail;
+    }
+
+    if ((ret = mdb_dbi_open(txn, NULL, 0, &store->dbi)) != 0
+	    || (ret = mdb_txn_commit(txn)) != 0)
+    {
+	lmdb_store_error(store, "mdb_dbi_open", ret);
+	mdb_txn_abort(txn);
+	goto fail;
+    }
+
+    return store;
+
+fail:
+    lmdb_store_close(&store);
+    return NULL;
+}
+
+void lmdb_store_close(struct lmdb_store **_store)
+{
+    struct lmdb_store *store = *_store;
+
+    *_store = NULL;
+
+    if (store->txn != NULL)
+	mdb_txn_abort(store->txn);
+    if (store->env != NULL)
+	mdb_env_close(store->env);
+    i_free(store->path);
+    i_free(store);
+}
+
+int lmdb_store_begin(struct lmdb_store *store)
+{
+    int ret;
+
+    i_assert(store->txn == NULL);
+
+    if ((ret = mdb_txn_begin(store->env, NULL, 0, &store->txn)) != 0)
+    {
+	lmdb_store_error(store, "mdb_txn_begin", ret);
+	store->txn = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+int lmdb_store_inc(struct lmdb_store *store, const char *key,
+	long long diff)
+{
+    MDB_val k, v;
+    int64_t value = 0;
+    int ret;
+
+    k.mv_size = strlen(key);
+    k.mv_data = (void *) key;
+
+    ret = mdb_get(store->txn, store->dbi, &k, &v);
+    if (ret == 0 && v.mv_size == sizeof(value))
+	memcpy(&value, v.mv_data, sizeof(value));
+    else if (ret != 0 && ret != MDB_NOTFOUND)
+    {
+	lmdb_store_error(store, "mdb_get", ret);
+	return -1;
+    }
+
+    value += diff;
+    v.mv_size = sizeof(value);
+    v.mv_data = &value;
+
+    if ((ret = mdb_put(store->txn, store->dbi, &k, &v, 0)) != 0)
+    {
+	lmdb_store_error(store, "mdb_put", ret);
+	return -1;
+    }
+
+    return 0;
+}
+
+int lmdb_store_unset(struct lmdb_store *store, const char *key)
+{
+    MDB_val k;
+    int ret;
+
+    k.mv_size = strlen(key);
+    k.mv_data = (void *) key;
+
+    ret = mdb_del(store->txn, store->dbi, &k, NULL);
+    if (ret != 0 && ret != MDB_NOTFOUND)
+    {
+	lmdb_store_error(store, "mdb_del", ret);
+	return -1;
+    }
+
+    return 0;
+}
+
+int lmdb_store_commit(struct lmdb_store *store)
+{
+    int ret = mdb_txn_commit(store->txn);
+
+    store->txn = NULL;
+
+    if (ret != 0)
+    {
+	lmdb_store_error(store, "mdb_txn_commit", ret);
+	return -1;
+    }
+
+    return 0;
+}
+
+void lmdb_store_rollback(struct lmdb_store *store)
+{
+    if (store->txn != NULL)
+	mdb_txn_abort(store->txn);
+    store->txn = NULL;
+}
+
+int lmdb_store_lookup(struct lmdb_store *store, const char *key,
+	long long *value_r)
+{
+    MDB_txn *txn = store->txn;
+    MDB_val k, v;
+    int64_t value;
+    int ret;
+
+    if (txn == NULL
+	    && (ret = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &txn)) != 0)
+    {
+	lmdb_store_error(store, "mdb_txn_begin", ret);
+	return -1;
+    }
+
+    k.mv_size = strlen(key);
+    k.mv_data = (void *) key;
+
+    ret = mdb_get(txn, store->dbi, &k, &v);
+    if (ret == 0 && v.mv_size == sizeof(value))
+    {
+	memcpy(&value, v.mv_data, sizeof(value));
+	*value_r = value;
+	ret = 1;
+    }
+    else if (ret == 0 || ret == MDB_NOTFOUND)
+	ret = 0;
+    else
+    {
+	lmdb_store_error(store, "mdb_get", ret);
+	ret = -1;
+    }
+
+    if (txn != store->txn)
+	mdb_txn_abort(txn);
+
+    return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef ANTISPAM_LMDB_STORE_H
+#define ANTISPAM_LMDB_STORE_H
+
+#include "lib.h"
+
+/*
+ * A local counter store in an LMDB database, used by the signature-log
+ * backend instead of a dict when no dict proxy is around. The values are
+ * int64_t in host byte order so the trainer can read them straight from
+ * the memory map. Only available if built with HAVE_LMDB.
+ */
+
+struct lmdb_store;
+
+/* Opens or creates the database file, NULL on error (which is logged). */
+struct lmdb_store *lmdb_store_open(const char *path, size_t map_size);
+void lmdb_store_close(struct lmdb_store **store);
+
+/*
+ * All the increments between begin and commit are applied in a single
+ * write transaction, which holds the database write lock meanwhile.
+ */
+int lmdb_store_begin(struct lmdb_store *store);
+int lmdb_store_inc(struct lmdb_store *store, const char *key,
+	long long diff);
+int lmdb_store_unset(struct lmdb_store *store, const char *key);
+int lmdb_store_commit(struct lmdb_store *store);
+void lmdb_store_rollback(struct lmdb_store *store);
+
+/* Returns 1 and sets value_r if key exists, 0 if not, -1 on error. */
+int lmdb_store_lookup(struct lmdb_store *store, const char *key,
+	long long *value_r);
+
+#endif
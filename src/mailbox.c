@@ -1,8 +1,13 @@
 #include "lib.h"
+#include "array.h"
 
 #include "user.h"
 #include "mailbox.h"
 #include "backends.h"
+#include "strmap.h"
+
+// how many mailbox names are remembered per user
+#define ANTISPAM_CLASS_CACHE_MAX 1024
 
 static MODULE_CONTEXT_DEFINE_INIT(antispam_storage_module,
 	&mail_storage_module_register);
@@ -15,6 +20,24 @@ struct antispam_transaction
 {
     union mailbox_transaction_module_context module_ctx;
     void *data;			// Backend specific data is stored here.
+
+    // the backend transaction is begun on the first trained mail
+    enum mailbox_transaction_flags flags;
+    bool begun;
+    bool batched;		// data goes to the user's batch on commit
+    unsigned int mails;		// handed to the backend
+
+    // copies waiting for the backend's handle_mails
+    struct mailbox *copied_box;
+    ARRAY_TYPE(antispam_mail_ref) copied;
+
+    // the wanted headers of copied_box or of the last copy's source
+    struct mailbox *wanted_box;
+    struct mailbox_header_lookup_ctx *wanted;
+
+    // copies to record in the ledger once they are trained
+    pool_t ledger_pool;
+    ARRAY_TYPE(antispam_ledger_entry) ledger;
 };
 
 enum mailbox_copy_type
@@ -27,31 +50,250 @@ enum mailbox_copy_type
 
 static enum mailbox_class antispam_mailbox_classify(struct mailbox *box)
 {
+    struct antispam_user *asu = USER_CONTEXT(box->storage->user);
     const char *name = mailbox_get_name(box);
+    enum mailbox_class box_class;
+    void *value;
+
+    if (strmap_lookup(asu->box_classes, name, &value))
+	return POINTER_CAST_TO(value, unsigned int);
+
+    box_class = folder_matcher_classify(asu->folders, name);
+
+    if (strmap_count(asu->box_classes) < ANTISPAM_CLASS_CACHE_MAX)
+	strmap_insert(asu->box_classes, name, POINTER_CAST(box_class));
+
+    return box_class;
+}
+
+static void antispam_backend_begin(struct mailbox_transaction_context *t)
+{
+    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
+    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+
+    if (ast->begun)
+	return;
+
+    ast->begun = TRUE;
+    ast->batched = antispam_batch_enabled(asu);
+    ast->data = asu->backend->transaction_begin(t->box->storage, ast->flags);
+    asu->stats.backend_transactions++;
+}
+
+/*
+ * Records the copies of a committed transaction in the ledger, or leaves
+ * that to the batch if the training is still to be done.
+ */
+static void antispam_ledger_commit(struct mailbox *box,
+	struct antispam_transaction *ast)
+{
+    struct antispam_user *asu = USER_CONTEXT(box->storage->user);
+    const struct antispam_ledger_entry *entry;
+
+    if (ast->ledger_pool == NULL)
+	return;
+
+    array_foreach(&ast->ledger, entry)
+    {
+	if (ast->batched)
+	    antispam_batch_add_ledger(asu, entry->guid, entry->spam);
+	else
+	    mmap_table_insert(asu->ledger, entry->guid, entry->spam ? 1 : 0);
+    }
+}
+
+static int antispam_backend_commit(struct mailbox *box,
+	struct antispam_transaction *ast)
+{
     struct antispam_user *asu = USER_CONTEXT(box->storage->user);
-    enum match_type i;
-    char **iter;
-
-#define CHECK(folders, class) \
-    for (i = 0; i < NUM_MT; i++) \
-    { \
-	iter = asu->folders[i]; \
-	if (!iter) \
-	    continue; \
-	while (*iter) \
-	{ \
-	    if (match_info[i].fn(name, *iter)) \
-		return class; \
-	    iter++; \
-	} \
+    int ret;
+
+    if (!ast->begun)
+	return 0;
+
+    if (ast->batched)
+    {
+	antispam_ledger_commit(box, ast);
+	antispam_batch_add(asu, box->storage, ast->data, ast->mails);
+	return 0;
+    }
+
+    ret = asu->backend->transaction_commit(box->storage, ast->data);
+    if (ret == 0)
+	antispam_ledger_commit(box, ast);
+    return ret;
+}
+
+static void antispam_backend_rollback(struct mailbox *box,
+	struct antispam_transaction *ast)
+{
+    struct antispam_user *asu = USER_CONTEXT(box->storage->user);
+
+    if (!ast->begun)
+	return;
+
+    // nothing of a batched transaction is in the batch before its commit
+    asu->backend->transaction_rollback(box->storage, ast->data);
+}
+
+/*
+ * Returns the headers the backend reads from the mails of box, so that
+ * they are all fetched in one go, from the cache file if they are there,
+ * instead of parsing the mail once per header. NULL if the backend reads
+ * whole mails or dovecot is too old.
+ */
+static struct mailbox_header_lookup_ctx *antispam_wanted_headers(struct
+	mailbox_transaction_context *t, struct mailbox *box)
+{
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
+    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+
+    if (asu->wanted_headers == NULL)
+	return NULL;
+
+    if (ast->wanted_box != box)
+    {
+	if (ast->wanted != NULL)
+	    mailbox_header_lookup_unref(&ast->wanted);
+	ast->wanted = mailbox_header_lookup_init(box, asu->wanted_headers);
+	ast->wanted_box = box;
+    }
+
+    return ast->wanted;
+#else
+    return NULL;
+#endif
+}
+
+/* Makes the copy itself fetch the headers handle_mail reads. */
+static void antispam_prefetch_headers(struct mailbox_transaction_context *t,
+	struct mail *mail)
+{
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    struct mailbox_header_lookup_ctx *wanted =
+	    antispam_wanted_headers(t, mail->box);
+
+    if (wanted != NULL)
+	mail_add_temp_wanted_fields(mail, 0, wanted);
+#endif
+}
+
+static int antispam_handle_mail(struct mailbox_transaction_context *t,
+	struct mail *mail, bool spam)
+{
+    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
+    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+
+    antispam_backend_begin(t);
+    ast->mails++;
+    return asu->backend->handle_mail(t, ast->data, mail, spam);
+}
+
+/*
+ * Hands the queued copies to the backend. The source mailbox is still open
+ * here, the copies are committed before their source is closed.
+ */
+static int antispam_flush_copied(struct mailbox_transaction_context *t)
+{
+    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
+    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+    struct mailbox_transaction_context *src_t;
+    const struct antispam_mail_ref *refs;
+    struct mail *mail;
+    unsigned int count;
+    int ret;
+
+    if (ast->copied_box == NULL)
+	return 0;
+
+    antispam_backend_begin(t);
+
+    refs = array_get(&ast->copied, &count);
+    ast->mails += count;
+
+    src_t = mailbox_transaction_begin(ast->copied_box, 0);
+    mail = mail_alloc(src_t, 0, antispam_wanted_headers(t, ast->copied_box));
+
+    ret = asu->backend->handle_mails(t, ast->data, mail, refs, count);
+
+    mail_free(&mail);
+    mailbox_transaction_rollback(&src_t);
+
+    array_clear(&ast->copied);
+    ast->copied_box = NULL;
+    return ret;
+}
+
+static int antispam_queue_copied(struct mailbox_transaction_context *t,
+	struct mail *mail, bool spam)
+{
+    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
+    struct antispam_mail_ref *ref;
+
+    if (ast->copied_box != mail->box && antispam_flush_copied(t) < 0)
+	return -1;
+
+    if (!array_is_created(&ast->copied))
+	i_array_init(&ast->copied, 64);
+
+    ast->copied_box = mail->box;
+    ref = array_append_space(&ast->copied);
+    ref->uid = mail->uid;
+    ref->spam = spam;
+    return 0;
+}
+
+/*
+ * Returns TRUE if the ledger says the mail was trained as spam or not spam
+ * already, e.g. as another client synced the same move. Otherwise the mail
+ * is recorded by antispam_ledger_commit() once it is trained.
+ */
+static bool antispam_ledger_check(struct mailbox_transaction_context *t,
+	struct mail *mail, bool spam)
+{
+    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
+    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+    struct antispam_ledger_entry *entry;
+    const char *guid;
+    unsigned int value;
+
+    if (asu->ledger == NULL)
+	return FALSE;
+
+    if (mail_get_special(mail, MAIL_FETCH_GUID, &guid) < 0 || *guid == '\0')
+	return FALSE;
+
+    if (mmap_table_lookup(asu->ledger, guid, 0, &value)
+	    && value == (spam ? 1 : 0))
+    {
+	asu->stats.ledger_skips++;
+	return TRUE;
     }
 
-    CHECK(folders_spam, CLASS_SPAM);
-    CHECK(folders_trash, CLASS_TRASH);
-    CHECK(folders_unsure, CLASS_UNSURE);
+    if (ast->ledger_pool == NULL)
+    {
+	ast->ledger_pool = pool_alloconly_create("antispam ledger", 1024);
+	p_array_init(&ast->ledger, ast->ledger_pool, 16);
+    }
 
-    return CLASS_OTHER;
-#undef CHECK
+    entry = array_append_space(&ast->ledger);
+    entry->guid = p_strdup(ast->ledger_pool, guid);
+    entry->spam = spam;
+    return FALSE;
+}
+
+static void antispam_transaction_free(struct antispam_transaction *ast)
+{
+    if (array_is_created(&ast->copied))
+	array_free(&ast->copied);
+    if (ast->ledger_pool != NULL)
+	pool_unref(&ast->ledger_pool);
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    if (ast->wanted != NULL)
+	mailbox_header_lookup_unref(&ast->wanted);
+#endif
+    i_free(ast);
 }
 
 static enum mailbox_copy_type antispam_classify_copy(enum mailbox_class src,
@@ -101,7 +343,6 @@ static int antispam_copy(struct mail_save_context *ctx, struct mail *mail)
     struct mailbox_transaction_context *t = ctx->transaction;
     struct antispam_mailbox *asmb = STORAGE_CONTEXT(t->box);
     struct antispam_mailbox *asms = STORAGE_CONTEXT(mail->box);
-    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
     struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
 
     enum mailbox_copy_type copy_type =
@@ -123,10 +364,20 @@ static int antispam_copy(struct mail_save_context *ctx, struct mail *mail)
 	    break;
     }
 
+    // the queued copies get them when they are looked up again
+    if (asu->backend->handle_mails == NULL)
+	antispam_prefetch_headers(t, mail);
+
     if (asmb->module_ctx.super.copy(ctx, mail) != 0)
 	return -1;
 
-    return asu->backend->handle_mail(t, ast->data, mail, copy_type == MCT_SPAM);
+    if (antispam_ledger_check(t, mail, copy_type == MCT_SPAM))
+	return 0;
+
+    if (asu->backend->handle_mails != NULL)
+	return antispam_queue_copied(t, mail, copy_type == MCT_SPAM);
+
+    return antispam_handle_mail(t, mail, copy_type == MCT_SPAM);
 }
 
 static int antispam_save_begin(struct mail_save_context *ctx,
@@ -166,8 +417,6 @@ static int antispam_save_finish(struct mail_save_context *ctx)
 {
     struct mailbox_transaction_context *t = ctx->transaction;
     struct antispam_mailbox *asmb = STORAGE_CONTEXT(t->box);
-    struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
-    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
 
     // if we are copying then copy() code will do everything needed
     int ret = asmb->module_ctx.super.save_finish(ctx);
@@ -179,8 +428,8 @@ static int antispam_save_finish(struct mail_save_context *ctx)
     enum mailbox_copy_type copy_type =
 	    antispam_classify_copy(CLASS_OTHER, asmb->box_class);
 
-    return copy_type == MCT_IGNORE ? 0 : asu->backend->handle_mail(t,
-	    ast->data, ctx->dest_mail, copy_type == MCT_SPAM);
+    return copy_type == MCT_IGNORE ? 0 : antispam_handle_mail(t,
+	    ctx->dest_mail, copy_type == MCT_SPAM);
 }
 
 static struct mailbox_transaction_context *antispam_transaction_begin(struct
@@ -194,7 +443,8 @@ static struct mailbox_transaction_context *antispam_transaction_begin(struct
     ret = asmb->module_ctx.super.transaction_begin(box, flags);
 
     astr = i_new(struct antispam_transaction, 1);
-    astr->data = asu->backend->transaction_begin(box, flags);
+    astr->flags = flags;
+    asu->stats.transactions++;
 
     MODULE_CONTEXT_SET(ret, antispam_transaction_module, astr);
 
@@ -207,18 +457,26 @@ static int antispam_transaction_commit(struct mailbox_transaction_context *t,
     int ret;
     struct mailbox *box = t->box;
     struct antispam_mailbox *asmb = STORAGE_CONTEXT(box);
-    struct antispam_user *asu = USER_CONTEXT(box->storage->user);
     struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
 
+    // a failed training fails the copy, like it does for handle_mail
+    if (antispam_flush_copied(t) < 0)
+    {
+	antispam_backend_rollback(box, ast);
+	asmb->module_ctx.super.transaction_rollback(t);
+	antispam_transaction_free(ast);
+	return -1;
+    }
+
     if ((ret = asmb->module_ctx.super.transaction_commit(t, changes_r)) != 0)
     {
-	asu->backend->transaction_rollback(box, ast->data);
-	i_free(ast);
+	antispam_backend_rollback(box, ast);
+	antispam_transaction_free(ast);
 	return ret;
     }
 
-    ret = asu->backend->transaction_commit(box, ast->data);
-    i_free(ast);
+    ret = antispam_backend_commit(box, ast);
+    antispam_transaction_free(ast);
     return ret;
 }
 
@@ -226,19 +484,48 @@ static void antispam_transaction_rollback(struct mailbox_transaction_context
 	*t)
 {
     struct antispam_mailbox *asmb = STORAGE_CONTEXT(t->box);
-    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
     struct antispam_transaction *ast = TRANSACTION_CONTEXT(t);
 
-    asu->backend->transaction_rollback(t->box, ast->data);
+    antispam_backend_rollback(t->box, ast);
     asmb->module_ctx.super.transaction_rollback(t);
-    i_free(ast);
+    antispam_transaction_free(ast);
+}
+
+unsigned int antispam_hooked_classes(const struct folder_matcher *folders)
+{
+    static const enum mailbox_class classes[] =
+	    { CLASS_OTHER, CLASS_SPAM, CLASS_TRASH, CLASS_UNSURE };
+    unsigned int src, dst, ret = 0;
+
+    for (dst = 0; dst < N_ELEMENTS(classes); dst++)
+    {
+	if (classes[dst] != CLASS_OTHER
+		&& !folder_matcher_has_class(folders, classes[dst]))
+	    continue;
+
+	// saves count as copies from an unclassified mailbox
+	for (src = 0; src < N_ELEMENTS(classes); src++)
+	{
+	    if (classes[src] != CLASS_OTHER
+		    && !folder_matcher_has_class(folders, classes[src]))
+		continue;
+
+	    if (antispam_classify_copy(classes[src], classes[dst])
+		    != MCT_IGNORE)
+		ret |= 1 << classes[dst];
+	}
+    }
+
+    return ret;
 }
 
 void antispam_mailbox_allocated(struct mailbox *box)
 {
+    struct antispam_user *asu = USER_CONTEXT(box->storage->user);
     struct antispam_mailbox *asmb;
 
-    if (USER_CONTEXT(box->storage->user) == NULL)
+    // no configured folder can ever be trained or denied
+    if (asu == NULL || asu->hooked_classes == 0)
 	return;
 
     asmb = p_new(box->pool, struct antispam_mailbox, 1);
@@ -246,12 +533,20 @@ void antispam_mailbox_allocated(struct mailbox *box)
 
     asmb->box_class = antispam_mailbox_classify(box);
 
-    box->v.copy = antispam_copy;
-    box->v.save_begin = antispam_save_begin;
-    box->v.save_finish = antispam_save_finish;
-    box->v.transaction_begin = antispam_transaction_begin;
-    box->v.transaction_commit = antispam_transaction_commit;
-    box->v.transaction_rollback = antispam_transaction_rollback;
+    /*
+     * The class is always recorded since antispam_copy() looks it up on
+     * the source mailbox, but copies into and saves to this mailbox only
+     * need to be seen if they can be trained or denied.
+     */
+    if ((asu->hooked_classes & (1 << asmb->box_class)) != 0)
+    {
+	box->v.copy = antispam_copy;
+	box->v.save_begin = antispam_save_begin;
+	box->v.save_finish = antispam_save_finish;
+	box->v.transaction_begin = antispam_transaction_begin;
+	box->v.transaction_commit = antispam_transaction_commit;
+	box->v.transaction_rollback = antispam_transaction_rollback;
+    }
 
     MODULE_CONTEXT_SET(box, antispam_storage_module, asmb);
 }
@@ -16,12 +16,20 @@ enum mailbox_class
     CLASS_UNSURE
 };
 
+struct folder_matcher;
+
 struct antispam_mailbox
 {
     union mailbox_module_context module_ctx;
     enum mailbox_class box_class;
 };
 
+/*
+ * Returns a bit mask of the classes whose mailboxes can see a copy or a
+ * save that is trained or denied, given the classes the matcher knows.
+ */
+unsigned int antispam_hooked_classes(const struct folder_matcher *folders);
+
 void antispam_mailbox_allocated(struct mailbox *box);
 
 #endif
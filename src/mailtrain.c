@@ -19,18 +19,24 @@
 
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "fd-close-on-exec.h"
 #include "str.h"
 #include "istream.h"
 #include "ostream.h"
 
 #include "aux.h"
 #include "backends.h"
+#include "executor.h"
 #include "mailbox.h"
 #include "mailtrain.h"
+#include "smtp.h"
+#include "strmap.h"
 #include "user.h"
 
 struct mailtrain_config
@@ -40,6 +46,12 @@ struct mailtrain_config
     unsigned int args_num;
     const char *spam;
     const char *non_spam;
+    bool batch_mbox;
+
+    // direct submission instead of running a binary
+    const char *submit_host;
+    const char *submit_from;
+    bool submit_lmtp;
 };
 
 bool mailtrain_init(struct mail_user *user, void **data)
@@ -51,13 +63,29 @@ bool mailtrain_init(struct mail_user *user, void **data)
     if (cfg == NULL)
 	goto fail;
 
-    tmp = config(user, "mail_sendmail");
-    if (EMPTY_STR(tmp))
+    tmp = config(user, "mail_submit_host");
+    if (!EMPTY_STR(tmp))
     {
-	i_debug("empty mail_sendmail");
-	goto bailout;
+	cfg->submit_host = tmp;
+
+	tmp = config(user, "mail_submit_lmtp");
+	if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	    cfg->submit_lmtp = TRUE;
+
+	cfg->submit_from = config(user, "mail_submit_from");
+	if (cfg->submit_from == NULL)
+	    cfg->submit_from = "";
+    }
+    else
+    {
+	tmp = config(user, "mail_sendmail");
+	if (EMPTY_STR(tmp))
+	{
+	    i_debug("empty mail_sendmail");
+	    goto bailout;
+	}
+	cfg->binary = tmp;
     }
-    cfg->binary = tmp;
 
     tmp = config(user, "mail_spam");
     if (EMPTY_STR(tmp))
@@ -82,6 +110,10 @@ bool mailtrain_init(struct mail_user *user, void **data)
 	cfg->args_num = str_array_length(cfg->args);
     }
 
+    tmp = config(user, "mail_batch_mbox");
+    if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	cfg->batch_mbox = TRUE;
+
     *data = cfg;
 
     return TRUE;
@@ -93,112 +125,419 @@ fail:
     return FALSE;
 }
 
+/*
+ * Mails stored in a plain file are not copied, their file is kept open
+ * until commit and handed to sendmail as stdin directly. This bounds the
+ * number of descriptors we keep open, the rest goes to the tmpdir.
+ */
+#define MAILTRAIN_MAX_OPEN_FILES 256
+
+#define MAILTRAIN_MBOX_BUFSIZE (64 * 1024)
+
+struct mailtrain_mail
+{
+    int fd;			// -1 if the mail was copied to the tmpdir
+    off_t offset;
+    unsigned int num;		// tmpdir file number
+    bool spam;
+    bool cancelled;		// by a later mail with the same GUID
+    const char *guid;		// NULL if the mail has none
+};
+ARRAY_DEFINE_TYPE(mailtrain_mail, struct mailtrain_mail);
+
 struct mailtrain_transaction_context
 {
     string_t *tmpdir;
     size_t tmplen;
     unsigned int messages;
+    unsigned int events;	// handled mails, before coalescing
+
+    ARRAY_TYPE(mailtrain_mail) mails;
+    unsigned int open_files;
+
+    // GUID -> index in mails + 1, NULL once cancelled
+    pool_t guid_pool;
+    struct strmap *guids;
 };
 
-static int run_sendmail(struct mail_storage *storage, int mailfd, bool spam)
+static void sendmail_callback(int status, const char *output ATTR_UNUSED,
+	void *context)
+{
+    bool *failed = context;
+
+    if (status != 0)
+	*failed = TRUE;
+}
+
+static int run_sendmail(struct executor *executor,
+	struct mailtrain_config *cfg, int mailfd, bool spam, bool *failed)
+{
+    const char **argv;
+    unsigned int i;
+
+    argv = t_new(const char *, 2 + cfg->args_num + 1);
+    argv[0] = cfg->binary;
+
+    for (i = 0; i < cfg->args_num; i++)
+	argv[i + 1] = cfg->args[i];
+
+    argv[i + 1] = spam ? cfg->spam : cfg->non_spam;
+
+    return executor_run(executor, cfg->binary, argv, mailfd, NULL, 0, 0,
+	    sendmail_callback, failed);
+}
+
+/*
+ * Returns a descriptor positioned at the beginning of the queued mail.
+ * *close_r tells whether the caller has to close it.
+ */
+static int open_mail(struct mailtrain_transaction_context *mttc,
+	unsigned int idx, bool *close_r)
+{
+    const struct mailtrain_mail *mail = array_idx(&mttc->mails, idx);
+    int fd;
+
+    if (mail->fd != -1)
+    {
+	*close_r = FALSE;
+	if (lseek(mail->fd, mail->offset, SEEK_SET) < 0)
+	    return -1;
+	return mail->fd;
+    }
+
+    str_printfa(mttc->tmpdir, "/%c%u", mail->spam ? 's' : 'h', mail->num);
+    fd = open(str_c(mttc->tmpdir), O_RDONLY);
+    str_truncate(mttc->tmpdir, mttc->tmplen);
+
+    *close_r = TRUE;
+    return fd;
+}
+
+static int process_tmpdir(struct mail_storage *storage,
+	struct mailtrain_transaction_context *mttc)
 {
     struct antispam_user *asu = USER_CONTEXT(storage->user);
     struct mailtrain_config *cfg = asu->backend_config;
-    const char *dest = spam ? cfg->spam : cfg->non_spam;
-    pid_t pid;
-    int status;
+    const struct mailtrain_mail *mails;
+    struct executor *executor;
+    unsigned int i, count;
+    bool need_close;
+    bool failed = FALSE;
+    int fd;
+    int rc = 0;
 
-    pid = fork();
+    mails = array_get(&mttc->mails, &count);
+    executor = executor_init(asu->exec_concurrency,
+		asu->spawn_helper ? storage->user->username : NULL);
 
-    if (pid == -1)
+    for (i = 0; !failed && i < count; i++)
     {
-	mail_storage_set_error(storage, MAIL_ERROR_TEMP, "couldn't fork");
+	if ((fd = open_mail(mttc, i, &need_close)) == -1)
+	{
+	    mail_storage_set_error_from_errno(storage);
+	    rc = -1;
+	    break;
+	}
+
+	T_BEGIN
+	{
+	    if (run_sendmail(executor, cfg, fd, mails[i].spam, &failed) != 0)
+		failed = TRUE;
+	}
+	T_END;
+
+	// the child has its own copy
+	if (need_close)
+	    close(fd);
+    }
+
+    executor_deinit(&executor);
+
+    return failed ? -1 : rc;
+}
+
+/*
+ * Appends the mail to the mbox being written, quoting the lines that
+ * would be taken for a message separator.
+ */
+static int write_mbox_mail(struct ostream *output, int fd, off_t offset)
+{
+    struct istream *input = i_stream_create_fd(fd, MAILTRAIN_MBOX_BUFSIZE,
+	    FALSE);
+    const unsigned char *data, *eol;
+    size_t size;
+    bool line_start = TRUE;
+    bool last_lf = TRUE;
+    int ret;
+
+    i_stream_seek(input, offset);
+
+    o_stream_send_str(output, t_strdup_printf("From antispam %s",
+		    ctime(&ioloop_time)));
+
+    while ((ret = i_stream_read_data(input, &data, &size,
+			    line_start ? 4 : 0)) > 0 || size > 0)
+    {
+	if (line_start && size >= 5 && memcmp(data, "From ", 5) == 0)
+	    o_stream_send(output, ">", 1);
+
+	eol = memchr(data, '\n', size);
+	if (eol != NULL)
+	    size = eol - data + 1;
+
+	o_stream_send(output, data, size);
+	i_stream_skip(input, size);
+
+	line_start = eol != NULL;
+	last_lf = data[size - 1] == '\n';
+    }
+
+    if (!last_lf)
+	o_stream_send(output, "\n", 1);
+    o_stream_send(output, "\n", 1);
+
+    ret = input->stream_errno != 0 ? -1 : 0;
+    i_stream_destroy(&input);
+    return ret;
+}
+
+/*
+ * Streams all the mails of one class into a single sendmail run as an
+ * mbox, e.g. for "sa-learn --mbox".
+ */
+static int process_tmpdir_mbox(struct mail_storage *storage,
+	struct mailtrain_transaction_context *mttc,
+	struct executor *executor, bool spam, bool *failed)
+{
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct mailtrain_config *cfg = asu->backend_config;
+    const struct mailtrain_mail *mails;
+    struct ostream *output;
+    unsigned int i, count;
+    bool need_close;
+    int pipes[2];
+    int fd, ret, rc = 0;
+
+    mails = array_get(&mttc->mails, &count);
+
+    for (i = 0; i < count; i++)
+	if (mails[i].spam == spam)
+	    break;
+
+    if (i == count)
+	return 0;
+
+    if (pipe(pipes) < 0)
+    {
+	mail_storage_set_error_from_errno(storage);
 	return -1;
     }
+    fd_close_on_exec(pipes[1], TRUE);
 
-    if (pid)
+    T_BEGIN
     {
-	if (waitpid(pid, &status, 0) == -1)
-	    return -1;
-	if (!WIFEXITED(status))
-	    return -1;
-	return WEXITSTATUS(status);
+	ret = run_sendmail(executor, cfg, pipes[0], spam, failed);
     }
-    else
+    T_END;
+    close(pipes[0]);
+
+    if (ret != 0)
     {
-	int dnull = open("/dev/null", O_WRONLY);
-	char **argv;
-	int sz = sizeof(char *) * (2 + cfg->args_num + 1);
-	unsigned int i;
+	close(pipes[1]);
+	mail_storage_set_error(storage, MAIL_ERROR_TEMP,
+		"couldn't fork");
+	return -1;
+    }
 
-	argv = i_new(char *, sz);
-	argv[0] = (char *) cfg->binary;
+    // the other class may be trained meanwhile, we may block here
+    output = o_stream_create_fd(pipes[1], 0, FALSE);
 
-	for (i = 0; i < cfg->args_num; i++)
-	    argv[i + 1] = (char *) cfg->args[i];
+    for (; rc == 0 && i < count; i++)
+    {
+	if (mails[i].spam != spam)
+	    continue;
 
-	argv[i + 1] = (char *) dest;
+	if ((fd = open_mail(mttc, i, &need_close)) == -1)
+	{
+	    mail_storage_set_error_from_errno(storage);
+	    rc = -1;
+	    break;
+	}
+
+	T_BEGIN
+	{
+	    rc = write_mbox_mail(output, fd,
+		    mails[i].fd == -1 ? 0 : mails[i].offset);
+	}
+	T_END;
+
+	if (need_close)
+	    close(fd);
+    }
 
-#define DUP(fd, target) \
-		if (dup2(fd, target) != target) \
-		{ \
-			mail_storage_set_error_from_errno(storage); \
-			return -1; \
-		}
+    if (o_stream_flush(output) < 0 || output->stream_errno != 0)
+	rc = -1;
 
-	DUP(mailfd, 0);
-	DUP(dnull, 1);
-	DUP(dnull, 2);
-#undef DUP
+    o_stream_destroy(&output);
+    close(pipes[1]);
 
-	execv(cfg->binary, argv);
-	_exit(1);
-	/* not reached */
-	return -1;
+    return rc;
+}
+
+static int submit_mail(struct smtp_connection *conn, int fd, off_t offset)
+{
+    struct istream *input = i_stream_create_fd(fd, MAILTRAIN_MBOX_BUFSIZE,
+	    FALSE);
+    const unsigned char *data;
+    size_t size;
+    int ret;
+
+    i_stream_seek(input, offset);
+
+    while (i_stream_read_data(input, &data, &size, 0) > 0 || size > 0)
+    {
+	smtp_message_data(conn, data, size);
+	i_stream_skip(input, size);
     }
+
+    ret = input->stream_errno != 0 ? -1 : 0;
+    i_stream_destroy(&input);
+    return ret;
 }
 
-static int process_tmpdir(struct mailbox *box,
+/*
+ * Sends all the mails over a single SMTP/LMTP connection instead of
+ * running sendmail for each of them.
+ */
+static int process_tmpdir_smtp(struct mail_storage *storage,
 	struct mailtrain_transaction_context *mttc)
 {
-    unsigned int cnt = mttc->messages;
-    int fd;
-    bool spam;
-    int rc = 0;
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct mailtrain_config *cfg = asu->backend_config;
+    const struct mailtrain_mail *mails;
+    struct smtp_connection *conn;
+    unsigned int i, count;
+    bool need_close;
+    int *results;
+    int fd, ret, rc = 0;
+
+    mails = array_get(&mttc->mails, &count);
+    if (count == 0)
+	return 0;
 
-    while (rc == 0 && cnt > 0)
+    conn = smtp_connect(cfg->submit_host, cfg->submit_lmtp);
+    if (conn == NULL)
     {
-	cnt--;
-	str_printfa(mttc->tmpdir, "/s%u", cnt);
-	spam = TRUE;
+	mail_storage_set_error(storage, MAIL_ERROR_TEMP,
+		"Failed to connect to the training mail server");
+	return -1;
+    }
 
-	if ((fd = open(str_c(mttc->tmpdir), O_RDONLY)) == -1)
+    results = i_new(int, count);
+
+    for (i = 0; i < count; i++)
+    {
+	ret = smtp_message_begin(conn, cfg->submit_from, NULL,
+		mails[i].spam ? cfg->spam : cfg->non_spam);
+	if (ret == -2)
+	    break;
+	if (ret == -1)
 	{
-	    str_truncate(mttc->tmpdir, mttc->tmplen);
-	    str_printfa(mttc->tmpdir, "/h%u", cnt);
-	    spam = FALSE;
-	    if ((fd = open(str_c(mttc->tmpdir), O_RDONLY)) == -1)
-	    {
-		mail_storage_set_error_from_errno(box->storage);
-		rc = -1;
-		break;
-	    }
+	    results[i] = -1;
+	    continue;
 	}
 
-	str_truncate(mttc->tmpdir, mttc->tmplen);
+	// the server waits for the body now, failing leaves it unterminated
+	if ((fd = open_mail(mttc, i, &need_close)) == -1)
+	{
+	    mail_storage_set_error_from_errno(storage);
+	    smtp_abort(&conn);
+	    rc = -1;
+	    break;
+	}
 
-	if (run_sendmail(box->storage, fd, spam) != 0)
+	ret = submit_mail(conn, fd, need_close ? 0 : mails[i].offset);
+	if (need_close)
+	    close(fd);
+	if (ret < 0)
+	{
+	    mail_storage_set_error(storage, MAIL_ERROR_TEMP,
+		    "Failed to read mail contents");
+	    smtp_abort(&conn);
 	    rc = -1;
+	    break;
+	}
 
-	close(fd);
+	if (smtp_message_end(conn, &results[i]) < 0)
+	    break;
     }
 
-    str_truncate(mttc->tmpdir, mttc->tmplen);
+    if ((conn != NULL && smtp_disconnect(&conn) < 0) || i < count)
+    {
+	if (rc == 0)
+	    mail_storage_set_error(storage, MAIL_ERROR_TEMP,
+		    "Lost connection to the training mail server");
+	rc = -1;
+    }
+
+    for (i = 0; rc == 0 && i < count; i++)
+    {
+	if (results[i] / 100 != 2)
+	{
+	    mail_storage_set_error(storage, MAIL_ERROR_TEMP,
+		    "Training mail server refused the mail");
+	    rc = -1;
+	}
+    }
+
+    i_free(results);
     return rc;
 }
 
+/* Removes the mails that were cancelled out before training them. */
+static void drop_cancelled(struct mailtrain_transaction_context *mttc)
+{
+    const struct mailtrain_mail *mails;
+    unsigned int i, count;
+
+    mails = array_get(&mttc->mails, &count);
+    for (i = 0; i < count;)
+    {
+	if (!mails[i].cancelled)
+	{
+	    i++;
+	    continue;
+	}
+
+	// a tmpdir copy is removed by clear_tmpdir()
+	if (mails[i].fd != -1)
+	{
+	    close(mails[i].fd);
+	    mttc->open_files--;
+	}
+	array_delete(&mttc->mails, i, 1);
+	mails = array_get(&mttc->mails, &count);
+    }
+}
+
 static void clear_tmpdir(struct mailtrain_transaction_context *mttc)
 {
+    const struct mailtrain_mail *mail;
+
+    array_foreach(&mttc->mails, mail)
+    {
+	if (mail->fd != -1)
+	    close(mail->fd);
+    }
+    array_free(&mttc->mails);
+
+    if (mttc->guid_pool != NULL)
+	pool_unref(&mttc->guid_pool);
+
+    // nothing was copied, the directory was never created
+    if (str_c(mttc->tmpdir)[mttc->tmplen - 1] == 'X')
+	return;
+
     while (mttc->messages > 0)
     {
 	mttc->messages--;
@@ -213,7 +552,7 @@ static void clear_tmpdir(struct mailtrain_transaction_context *mttc)
     rmdir(str_c(mttc->tmpdir));
 }
 
-void *mailtrain_transaction_begin(struct mailbox *box,
+void *mailtrain_transaction_begin(struct mail_storage *storage,
 	enum mailbox_transaction_flags flags ATTR_UNUSED)
 {
     struct mailtrain_transaction_context *mttc = NULL;
@@ -232,16 +571,20 @@ void *mailtrain_transaction_begin(struct mailbox *box,
 	return NULL;
     }
 
-    mail_user_set_get_temp_prefix(mttc->tmpdir, box->storage->user->set);
+    mail_user_set_get_temp_prefix(mttc->tmpdir, storage->user->set);
     str_append(mttc->tmpdir, "XXXXXX");
 
     mttc->tmplen = str_len(mttc->tmpdir);
 
+    i_array_init(&mttc->mails, 32);
+
     return mttc;
 }
 
-int mailtrain_transaction_commit(struct mailbox *box, void *data)
+int mailtrain_transaction_commit(struct mail_storage *storage, void *data)
 {
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct mailtrain_config *cfg = asu->backend_config;
     struct mailtrain_transaction_context *mttc = data;
     int ret;
 
@@ -254,7 +597,27 @@ int mailtrain_transaction_commit(struct mailbox *box, void *data)
 	return 0;
     }
 
-    ret = process_tmpdir(box, mttc);
+    drop_cancelled(mttc);
+    asu->stats.coalesced_events += mttc->events - array_count(&mttc->mails);
+
+    if (cfg->submit_host != NULL)
+	ret = process_tmpdir_smtp(storage, mttc);
+    else if (cfg->batch_mbox)
+    {
+	struct executor *executor = executor_init(asu->exec_concurrency,
+		asu->spawn_helper ? storage->user->username : NULL);
+	bool failed = FALSE;
+
+	ret = process_tmpdir_mbox(storage, mttc, executor, TRUE, &failed);
+	if (ret == 0)
+	    ret = process_tmpdir_mbox(storage, mttc, executor, FALSE, &failed);
+
+	executor_deinit(&executor);
+	if (failed)
+	    ret = -1;
+    }
+    else
+	ret = process_tmpdir(storage, mttc);
 
     clear_tmpdir(mttc);
 
@@ -264,7 +627,7 @@ int mailtrain_transaction_commit(struct mailbox *box, void *data)
     return ret;
 }
 
-void mailtrain_transaction_rollback(struct mailbox *box ATTR_UNUSED,
+void mailtrain_transaction_rollback(struct mail_storage *storage ATTR_UNUSED,
 	void *data)
 {
     struct mailtrain_transaction_context *mttc = data;
@@ -281,23 +644,92 @@ void mailtrain_transaction_rollback(struct mailbox *box ATTR_UNUSED,
     i_free(mttc);
 }
 
-int mailtrain_handle_mail(struct mailbox_transaction_context *t, void *data,
-	struct mail *mail, bool spam)
+/*
+ * Returns a private descriptor of the file backing the mail if the file
+ * contains exactly the mail (e.g. maildir), or -1 if the mail has to be
+ * copied. The descriptor shares the file offset with dovecot's one, which
+ * is fine since dovecot reads files with pread().
+ */
+static int mailtrain_get_mail_fd(struct mail *mail, struct istream *input,
+	bool skip_from_line, off_t *offset_r)
+{
+    struct stat st;
+    uoff_t size;
+    int fd;
+
+    *offset_r = 0;
+
+    fd = i_stream_get_fd(input);
+    if (fd == -1 || input->v_offset != 0)
+	return -1;
+
+    // compressed or otherwise wrapped mails have a different size
+    if (mail_get_physical_size(mail, &size) < 0 || fstat(fd, &st) < 0
+	    || !S_ISREG(st.st_mode) || (uoff_t) st.st_size != size)
+	return -1;
+
+    if (skip_from_line)
+    {
+	char buf[1024];
+	const char *eol;
+	ssize_t ret;
+
+	ret = pread(fd, buf, sizeof(buf), 0);
+	if (ret < 5)
+	    return -1;
+
+	if (memcmp("From ", buf, 5) == 0)
+	{
+	    eol = memchr(buf, '\n', ret);
+	    if (eol == NULL)
+		return -1;
+	    *offset_r = eol - buf + 1;
+	}
+    }
+
+    // keep the other children from inheriting it
+    fd = dup(fd);
+    if (fd != -1)
+	fd_close_on_exec(fd, TRUE);
+    return fd;
+}
+
+static int queue_mail(struct mailbox_transaction_context *t,
+	struct mailtrain_transaction_context *mttc, struct mail *mail,
+	bool spam)
 {
-    struct mailtrain_transaction_context *mttc = data;
     struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+    struct mailtrain_mail *entry;
     struct istream *mailstream;
     struct ostream *outstream;
     int ret = 0;
     int fd;
+    off_t offset;
 
-    if (mttc == NULL)
+    if (mail_get_stream(mail, NULL, NULL, &mailstream) != 0)
     {
-	mail_storage_set_error(t->box->storage, MAIL_ERROR_NOTPOSSIBLE,
-		"Internal error during transaction initialization");
+	mail_storage_set_error(t->box->storage, MAIL_ERROR_EXPUNGED,
+		"Failed to get mail contents");
 	return -1;
     }
 
+    if (mttc->open_files < MAILTRAIN_MAX_OPEN_FILES)
+    {
+	fd = mailtrain_get_mail_fd(mail, mailstream, asu->skip_from_line,
+		&offset);
+	if (fd != -1)
+	{
+	    entry = array_append_space(&mttc->mails);
+	    entry->fd = fd;
+	    entry->offset = offset;
+	    entry->num = mttc->messages;
+	    entry->spam = spam;
+	    mttc->open_files++;
+	    mttc->messages++;
+	    return 0;
+	}
+    }
+
     if (str_c(mttc->tmpdir)[mttc->tmplen - 1] == 'X'
 	    && mkdtemp(str_c_modifiable(mttc->tmpdir)) == NULL)
     {
@@ -306,13 +738,6 @@ int mailtrain_handle_mail(struct mailbox_transaction_context *t, void *data,
 	return -1;
     }
 
-    if (mail_get_stream(mail, NULL, NULL, &mailstream) != 0)
-    {
-	mail_storage_set_error(t->box->storage, MAIL_ERROR_EXPUNGED,
-		"Failed to get mail contents");
-	return -1;
-    }
-
     str_printfa(mttc->tmpdir, "/%c%u", spam ? 's' : 'h', mttc->messages);
 
     fd = creat(str_c(mttc->tmpdir), 0600);
@@ -323,8 +748,11 @@ int mailtrain_handle_mail(struct mailbox_transaction_context *t, void *data,
 	goto out;
     }
 
+    entry = array_append_space(&mttc->mails);
+    entry->fd = -1;
+    entry->num = mttc->messages;
+    entry->spam = spam;
     mttc->messages++;
-
     outstream = o_stream_create_fd(fd, 0, FALSE);
     if (!outstream)
     {
@@ -372,3 +800,143 @@ out:
 
     return ret;
 }
+
+/*
+ * Nets the mail against the ones queued before with the same GUID: the
+ * same class again needs no training, the other class cancels the queued
+ * one out. Returns TRUE if the mail isn't to be queued.
+ */
+static bool coalesce_mail(struct mailtrain_transaction_context *mttc,
+	const char *guid, bool spam)
+{
+    struct mailtrain_mail *entry;
+    void *value;
+
+    if (mttc->guids == NULL
+	    || !strmap_lookup(mttc->guids, guid, &value) || value == NULL)
+	return FALSE;
+
+    entry = array_idx_modifiable(&mttc->mails,
+	    POINTER_CAST_TO(value, unsigned int) - 1);
+
+    if (entry->spam != spam)
+    {
+	entry->cancelled = TRUE;
+	strmap_insert(mttc->guids, guid, NULL);
+    }
+
+    return TRUE;
+}
+
+/* Makes the last queued mail the one coalesce_mail() finds for the GUID. */
+static void index_mail(struct mailtrain_transaction_context *mttc,
+	const char *guid)
+{
+    struct mailtrain_mail *entry;
+    unsigned int count;
+
+    if (mttc->guids == NULL)
+    {
+	mttc->guid_pool = pool_alloconly_create("mailtrain guids", 1024);
+	mttc->guids = strmap_create(mttc->guid_pool, 64);
+    }
+
+    count = array_count(&mttc->mails);
+    entry = array_idx_modifiable(&mttc->mails, count - 1);
+    entry->guid = p_strdup(mttc->guid_pool, guid);
+    strmap_insert(mttc->guids, guid, POINTER_CAST(count));
+}
+
+int mailtrain_handle_mail(struct mailbox_transaction_context *t, void *data,
+	struct mail *mail, bool spam)
+{
+    struct mailtrain_transaction_context *mttc = data;
+    const char *guid;
+
+    if (mttc == NULL)
+    {
+	mail_storage_set_error(t->box->storage, MAIL_ERROR_NOTPOSSIBLE,
+		"Internal error during transaction initialization");
+	return -1;
+    }
+
+    mttc->events++;
+
+    if (mail_get_special(mail, MAIL_FETCH_GUID, &guid) < 0 || *guid == '\0')
+	guid = NULL;
+
+    if (guid != NULL && coalesce_mail(mttc, guid, spam))
+	return 0;
+
+    if (queue_mail(t, mttc, mail, spam) < 0)
+	return -1;
+
+    if (guid != NULL)
+	index_mail(mttc, guid);
+
+    return 0;
+}
+
+/*
+ * The mails of src are handed over as open descriptors, so that the copies
+ * in its tmpdir stay readable after it is cleared.
+ */
+bool mailtrain_transaction_merge(struct mail_storage *storage, void *dst,
+	void *src)
+{
+    struct mailtrain_transaction_context *dst_mttc = dst;
+    struct mailtrain_transaction_context *src_mttc = src;
+    struct mailtrain_mail *mails, *entry;
+    unsigned int i, count;
+
+    if (dst_mttc == NULL || src_mttc == NULL || dst_mttc->tmpdir == NULL
+	    || src_mttc->tmpdir == NULL)
+	return FALSE;
+
+    drop_cancelled(src_mttc);
+    mails = array_get_modifiable(&src_mttc->mails, &count);
+
+    if (dst_mttc->open_files + count > MAILTRAIN_MAX_OPEN_FILES)
+	return FALSE;
+
+    for (i = 0; i < count; i++)
+    {
+	bool need_close;
+	int fd;
+
+	if (mails[i].fd != -1)
+	    continue;
+
+	fd = open_mail(src_mttc, i, &need_close);
+	if (fd == -1)
+	    return FALSE;
+
+	fd_close_on_exec(fd, TRUE);
+	mails[i].fd = fd;
+	mails[i].offset = 0;
+	src_mttc->open_files++;
+    }
+
+    dst_mttc->events += src_mttc->events;
+
+    for (i = 0; i < count; i++)
+    {
+	if (mails[i].guid == NULL
+		|| !coalesce_mail(dst_mttc, mails[i].guid, mails[i].spam))
+	{
+	    entry = array_append_space(&dst_mttc->mails);
+	    *entry = mails[i];
+	    entry->guid = NULL;
+	    dst_mttc->open_files++;
+
+	    if (mails[i].guid != NULL)
+		index_mail(dst_mttc, mails[i].guid);
+
+	    // dst closes it now
+	    mails[i].fd = -1;
+	}
+    }
+
+    mailtrain_transaction_rollback(storage, src);
+    return TRUE;
+}
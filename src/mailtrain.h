@@ -7,10 +7,12 @@
 
 bool mailtrain_init(struct mail_user *user, void **data);
 
-void *mailtrain_transaction_begin(struct mailbox *box,
+void *mailtrain_transaction_begin(struct mail_storage *storage,
 	enum mailbox_transaction_flags flags);
-int mailtrain_transaction_commit(struct mailbox *box, void *data);
-void mailtrain_transaction_rollback(struct mailbox *box, void *data);
+int mailtrain_transaction_commit(struct mail_storage *storage, void *data);
+void mailtrain_transaction_rollback(struct mail_storage *storage, void *data);
+bool mailtrain_transaction_merge(struct mail_storage *storage, void *dst,
+	void *src);
 int mailtrain_handle_mail(struct mailbox_transaction_context *t, void *data,
 	struct mail *mail, bool spam);
 
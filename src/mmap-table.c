@@ -0,0 +1,235 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lib.h"
+#include "ioloop.h"
+
+#include "mmap-table.h"
+
+#define MMAP_TABLE_MAGIC 0x41535431	// "AST1"
+// slots looked at for a key, the neighbourhood it may live in
+#define MMAP_TABLE_PROBES 8
+
+struct mmap_table_header
+{
+    uint32_t magic;
+    uint32_t slots;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t unused[5];
+};
+
+/*
+ * hash is 0 for an empty slot. data is the time stored (40 bits), a check
+ * hash of the key (16 bits) and the value (8 bits), so that it is updated
+ * with a single store.
+ */
+struct mmap_table_slot
+{
+    uint64_t hash;
+    uint64_t data;
+};
+
+struct mmap_table
+{
+    void *map;
+    size_t size;
+    struct mmap_table_header *hdr;
+    struct mmap_table_slot *slots;
+    unsigned int count;
+};
+
+static uint64_t mmap_table_hash(const char *key, uint16_t *check_r)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint16_t check = 0;
+
+    for (; *key != '\0'; key++)
+    {
+	hash = (hash ^ (unsigned char) *key) * 1099511628211ULL;
+	check = (check << 5) + check + (unsigned char) *key;
+    }
+
+    *check_r = check;
+    return hash == 0 ? 1 : hash;
+}
+
+static uint64_t mmap_table_data(uint16_t check, unsigned int value)
+{
+    return ((uint64_t) ioloop_time << 24) | ((uint64_t) check << 8)
+	    | (value & 0xff);
+}
+
+struct mmap_table *mmap_table_open(const char *path, unsigned int slots)
+{
+    struct mmap_table *table;
+    struct stat st;
+    uint32_t magic = 0;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0660);
+    if (fd == -1)
+    {
+	i_error("antispam: open(%s) failed: %m", path);
+	return NULL;
+    }
+
+    // racing creators all truncate to the same size
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && slots > 0
+	    && ftruncate(fd, sizeof(struct mmap_table_header)
+		    + (off_t) slots * sizeof(struct mmap_table_slot)) < 0)
+    {
+	i_error("antispam: ftruncate(%s) failed: %m", path);
+	close(fd);
+	return NULL;
+    }
+
+    if (fstat(fd, &st) < 0)
+    {
+	i_error("antispam: fstat(%s) failed: %m", path);
+	close(fd);
+	return NULL;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct mmap_table_header)
+	    + sizeof(struct mmap_table_slot))
+    {
+	i_error("antispam: %s is too small for a table", path);
+	close(fd);
+	return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+	i_error("antispam: mmap(%s) failed: %m", path);
+	return NULL;
+    }
+
+    table = i_new(struct mmap_table, 1);
+    table->map = map;
+    table->size = st.st_size;
+    table->hdr = map;
+    table->slots = (struct mmap_table_slot *) (table->hdr + 1);
+    table->count = (table->size - sizeof(struct mmap_table_header))
+	    / sizeof(struct mmap_table_slot);
+
+    if (!__atomic_compare_exchange_n(&table->hdr->magic, &magic,
+		MMAP_TABLE_MAGIC, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+	    && magic != MMAP_TABLE_MAGIC)
+    {
+	i_error("antispam: %s is not an antispam table", path);
+	mmap_table_close(&table);
+	return NULL;
+    }
+    __atomic_store_n(&table->hdr->slots, table->count, __ATOMIC_RELAXED);
+
+    return table;
+}
+
+void mmap_table_close(struct mmap_table **_table)
+{
+    struct mmap_table *table = *_table;
+
+    *_table = NULL;
+
+    if (munmap(table->map, table->size) < 0)
+	i_error("antispam: munmap() failed: %m");
+    i_free(table);
+}
+
+bool mmap_table_lookup(struct mmap_table *table, const char *key,
+	unsigned int ttl, unsigned int *value_r)
+{
+    struct mmap_table_slot *slot;
+    uint64_t hash, found, data;
+    uint16_t check;
+    unsigned int i, start;
+
+    hash = mmap_table_hash(key, &check);
+    start = hash % table->count;
+
+    for (i = 0; i < MMAP_TABLE_PROBES && i < table->count; i++)
+    {
+	slot = &table->slots[(start + i) % table->count];
+
+	found = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+	if (found == 0)
+	    break;	// nothing is ever removed, so it isn't further on
+	if (found != hash)
+	    continue;
+
+	data = __atomic_load_n(&slot->data, __ATOMIC_ACQUIRE);
+	if ((uint16_t) (data >> 8) != check)
+	    break;	// being taken over, the data isn't ours yet
+	if (ttl != 0 && (time_t) (data >> 24) + ttl < ioloop_time)
+	    break;
+
+	*value_r = data & 0xff;
+	__atomic_fetch_add(&table->hdr->hits, 1, __ATOMIC_RELAXED);
+	return TRUE;
+    }
+
+    __atomic_fetch_add(&table->hdr->misses, 1, __ATOMIC_RELAXED);
+    return FALSE;
+}
+
+void mmap_table_insert(struct mmap_table *table, const char *key,
+	unsigned int value)
+{
+    struct mmap_table_slot *slot, *victim = NULL;
+    uint64_t hash, old, stamp, victim_hash = 0, oldest = (uint64_t) -1;
+    uint16_t check;
+    unsigned int i, start;
+
+    hash = mmap_table_hash(key, &check);
+    start = hash % table->count;
+
+    for (i = 0; i < MMAP_TABLE_PROBES && i < table->count; i++)
+    {
+	slot = &table->slots[(start + i) % table->count];
+	old = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+	if (old == hash)
+	{
+	    __atomic_store_n(&slot->data, mmap_table_data(check, value),
+		    __ATOMIC_RELEASE);
+	    return;
+	}
+
+	if (old == 0)
+	{
+	    victim = slot;
+	    victim_hash = 0;
+	    break;
+	}
+
+	stamp = __atomic_load_n(&slot->data, __ATOMIC_RELAXED) >> 24;
+	if (stamp < oldest)
+	{
+	    oldest = stamp;
+	    victim = slot;
+	    victim_hash = old;
+	}
+    }
+
+    // someone else took the slot meanwhile, it's only a cache
+    if (victim == NULL
+	    || !__atomic_compare_exchange_n(&victim->hash, &victim_hash, hash,
+		    FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	return;
+
+    __atomic_store_n(&victim->data, mmap_table_data(check, value),
+	    __ATOMIC_RELEASE);
+}
+
+void mmap_table_get_stats(struct mmap_table *table, uint64_t *hits_r,
+	uint64_t *misses_r)
+{
+    *hits_r = __atomic_load_n(&table->hdr->hits, __ATOMIC_RELAXED);
+    *misses_r = __atomic_load_n(&table->hdr->misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+#ifndef ANTISPAM_MMAP_TABLE_H
+#define ANTISPAM_MMAP_TABLE_H
+
+#include "lib.h"
+
+/*
+ * A fixed-size hash table in a shared memory-mapped file, mapping string
+ * keys (only their 64 bit hash is kept) to small values with the time they
+ * were stored. Processes update it concurrently without locks; a full
+ * neighbourhood evicts its oldest entry, so the table is a cache and may
+ * forget keys, but never returns a value stored for another key unless
+ * both the 64 bit and a 16 bit check hash collide.
+ *
+ * The file starts with a 64 byte header of which the first three fields
+ * are a magic number (uint32_t), the slot count (uint32_t) and the host-
+ * wide lookup hits and misses (uint64_t each), so tools can read them.
+ */
+
+struct mmap_table;
+
+/*
+ * Opens the table, creating it with the given number of slots if the file
+ * is empty. An existing table keeps its size. Returns NULL on error, which
+ * is logged.
+ */
+struct mmap_table *mmap_table_open(const char *path, unsigned int slots);
+void mmap_table_close(struct mmap_table **table);
+
+/*
+ * Returns TRUE and sets value_r if key was stored less than ttl seconds
+ * ago, or at all if ttl is 0.
+ */
+bool mmap_table_lookup(struct mmap_table *table, const char *key,
+	unsigned int ttl, unsigned int *value_r);
+/* Stores the value (0-255) of key with the current time. */
+void mmap_table_insert(struct mmap_table *table, const char *key,
+	unsigned int value);
+
+void mmap_table_get_stats(struct mmap_table *table, uint64_t *hits_r,
+	uint64_t *misses_r);
+
+#endif
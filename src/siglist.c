@@ -0,0 +1,108 @@
+#include "lib.h"
+
+#include "siglist.h"
+#include "strmap.h"
+
+struct siglist *signature_list_create(void)
+{
+    pool_t pool = pool_alloconly_create("antispam signatures", 4096);
+    struct siglist *list = p_new(pool, struct siglist, 1);
+
+    list->pool = pool;
+    list->index = strmap_create(pool, 64);
+    return list;
+}
+
+static void signature_list_link(struct siglist *list,
+	struct siglist_item *item)
+{
+    item->prev = list->tail;
+    item->next = NULL;
+
+    if (list->tail == NULL)
+	list->head = item;
+    else
+	list->tail->next = item;
+    list->tail = item;
+    list->count++;
+}
+
+void signature_list_unlink(struct siglist *list,
+	struct siglist_item *item)
+{
+    if (item->prev == NULL)
+	list->head = item->next;
+    else
+	item->prev->next = item->next;
+
+    if (item->next == NULL)
+	list->tail = item->prev;
+    else
+	item->next->prev = item->prev;
+
+    item->prev = item->next = NULL;
+    list->count--;
+}
+
+static void signature_list_add(struct siglist *list, const char *sig,
+	int net)
+{
+    struct siglist_item *item;
+    bool linked;
+    void *value;
+
+    if (strmap_lookup(list->index, sig, &value))
+	item = value;
+    else
+    {
+	item = p_new(list->pool, struct siglist_item, 1);
+	item->sig = p_strdup(list->pool, sig);
+	strmap_insert(list->index, item->sig, item);
+    }
+
+    // repeats collapse first, so spam, spam, ham trains nothing
+    linked = item->net != 0;
+    item->net += net;
+    if (item->net > 1)
+	item->net = 1;
+    else if (item->net < -1)
+	item->net = -1;
+    item->spam = item->net > 0;
+
+    if (linked && item->net == 0)
+	signature_list_unlink(list, item);
+    else if (!linked && item->net != 0)
+	signature_list_link(list, item);
+}
+
+void signature_list_append(struct siglist *list, const char *sig, bool spam)
+{
+    if (sig == NULL)
+	return;
+
+    list->events++;
+    signature_list_add(list, sig, spam ? 1 : -1);
+}
+
+void signature_list_merge(struct siglist *dst, const struct siglist *src)
+{
+    const struct siglist_item *item;
+
+    dst->events += src->events;
+
+    for (item = src->head; item != NULL; item = item->next)
+	signature_list_add(dst, item->sig, item->net);
+}
+
+void signature_list_free(struct siglist **_list)
+{
+    struct siglist *list = *_list;
+    pool_t pool;
+
+    if (list == NULL)
+	return;
+
+    *_list = NULL;
+    pool = list->pool;
+    pool_unref(&pool);
+}
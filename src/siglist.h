@@ -0,0 +1,43 @@
+#ifndef ANTISPAM_SIGLIST_H
+#define ANTISPAM_SIGLIST_H
+
+#include "lib.h"
+
+struct siglist_item
+{
+    const char *sig;
+    bool spam;
+    int net;			// 1 spam, -1 ham, 0 cancelled out
+    struct siglist_item *prev, *next;
+};
+
+/*
+ * The signatures trained by one transaction. The items and strings live
+ * in one alloconly pool which is dropped as a whole when the list is
+ * freed.
+ *
+ * Events are netted per signature: repeated events collapse into one
+ * item and a spam and a ham event for the same signature cancel out, in
+ * which case the item is unlinked until the signature shows up again.
+ * Repeats collapse before cancelling, as mailtrain does with the copies of
+ * a mail: spam, spam, ham trains nothing.
+ */
+struct siglist
+{
+    pool_t pool;
+    struct strmap *index;	// signature -> item
+    struct siglist_item *head, *tail;
+    unsigned int count;		// linked items
+    unsigned int events;	// appended signatures
+};
+
+struct siglist *signature_list_create(void);
+void signature_list_append(struct siglist *list, const char *sig, bool spam);
+/* Nets the events of src into dst as if they were appended there. */
+void signature_list_merge(struct siglist *dst, const struct siglist *src);
+void signature_list_free(struct siglist **list);
+
+/* Takes item off the list, it stays in the index. */
+void signature_list_unlink(struct siglist *list, struct siglist_item *item);
+
+#endif
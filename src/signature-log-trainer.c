@@ -0,0 +1,255 @@
+#include <stdlib.h>
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "dict.h"
+
+#include "signature-log-trainer.h"
+
+struct signature_log_drained
+{
+    const char *key;
+    long long value;		// taken off, 0 to remove the key
+};
+ARRAY_DEFINE_TYPE(signature_log_drained, struct signature_log_drained);
+
+int signature_log_generation_lookup(struct dict *dict,
+	unsigned int *generation_r)
+{
+    const char *value;
+    int ret;
+
+    *generation_r = 0;
+
+    T_BEGIN
+    {
+	ret = dict_lookup(dict, unsafe_data_stack_pool,
+		SIGLOG_GENERATION_KEY, &value);
+	if (ret > 0)
+	    *generation_r = strtoul(value, NULL, 10);
+    }
+    T_END;
+
+    return ret < 0 ? -1 : 0;
+}
+
+int signature_log_generation_advance(struct dict *dict,
+	unsigned int *frozen_r)
+{
+    struct dict_transaction_context *ctx;
+    unsigned int generation;
+    int ret;
+
+    ctx = dict_transaction_begin(dict);
+    dict_atomic_inc(ctx, SIGLOG_GENERATION_KEY, 1);
+    ret = dict_transaction_commit(&ctx);
+
+    if (ret == 0)
+    {
+	// no generation yet, the writers are in the 0th
+	ctx = dict_transaction_begin(dict);
+	dict_set(ctx, SIGLOG_GENERATION_KEY, "1");
+	ret = dict_transaction_commit(&ctx);
+    }
+
+    if (ret < 0 || signature_log_generation_lookup(dict, &generation) < 0)
+	return -1;
+
+    *frozen_r = generation - 1;
+    return 0;
+}
+
+/*
+ * Drains the next batch_size counters after *cursor in key order. The
+ * values are taken off with a decrement rather than by removing the keys,
+ * so that an increment landing between the lookup and the removal isn't
+ * lost. Only the counters that are down to 0 in a generation older than
+ * the one drained, which no writer can still be in, are removed. Returns 1
+ * at the end of the scan, 0 if there is more and -1 on error; *found_r is
+ * set if anything was changed.
+ */
+static int signature_log_drain_batch(struct dict *dict,
+	unsigned int generation, unsigned int batch_size, char **cursor,
+	signature_log_drain_callback_t *callback, void *context, bool *found_r)
+{
+    struct dict_iterate_context *iter;
+    struct dict_transaction_context *ctx;
+    ARRAY_TYPE(signature_log_drained) drained;
+    const struct signature_log_drained *entry;
+    struct signature_log_drained *new_entry;
+    const char *key, *value, *name, *last = NULL;
+    unsigned long gen;
+    long long count;
+    char *end;
+    bool more = FALSE;
+
+    t_array_init(&drained, batch_size);
+
+    iter = dict_iterate_init(dict, SIGLOG_GEN_PREFIX,
+	    DICT_ITERATE_FLAG_RECURSE | DICT_ITERATE_FLAG_SORT_BY_KEY);
+    while (dict_iterate(iter, &key, &value))
+    {
+	if (*cursor != NULL && strcmp(key, *cursor) <= 0)
+	    continue;
+
+	if (array_count(&drained) == batch_size)
+	{
+	    more = TRUE;
+	    break;
+	}
+
+	// <generation>/<key>, the writers are in the newer ones
+	gen = strtoul(key + strlen(SIGLOG_GEN_PREFIX), &end, 10);
+	if (*end != '/' || gen > generation)
+	    continue;
+	name = end + 1;
+
+	count = strtoll(value, NULL, 10);
+	if (count == 0 && gen == generation)
+	    continue;
+
+	last = t_strdup(key);
+	new_entry = array_append_space(&drained);
+	new_entry->key = last;
+	new_entry->value = count;
+
+	if (count != 0)
+	    callback(name, count, context);
+    }
+
+    if (dict_iterate_deinit(&iter) < 0)
+	return -1;
+
+    if (array_count(&drained) > 0)
+    {
+	ctx = dict_transaction_begin(dict);
+	array_foreach(&drained, entry)
+	{
+	    if (entry->value != 0)
+		dict_atomic_inc(ctx, entry->key, -entry->value);
+	    else
+		dict_unset(ctx, entry->key);
+	}
+
+	if (dict_transaction_commit(&ctx) < 0)
+	    return -1;
+
+	*found_r = TRUE;
+    }
+
+    i_free(*cursor);
+    *cursor = more ? i_strdup(last) : NULL;
+    return more ? 0 : 1;
+}
+
+int signature_log_generation_drain(struct dict *dict, unsigned int generation,
+	unsigned int batch_size, signature_log_drain_callback_t *callback,
+	void *context)
+{
+    char *cursor = NULL;
+    bool found = FALSE;
+    int ret;
+
+    if (batch_size == 0)
+	batch_size = 1;
+
+    for (;;)
+    {
+	T_BEGIN
+	{
+	    ret = signature_log_drain_batch(dict, generation, batch_size,
+		    &cursor, callback, context, &found);
+	}
+	T_END;
+
+	if (ret < 0)
+	    break;
+
+	// scanned through, again until a scan finds nothing
+	if (ret > 0)
+	{
+	    if (!found)
+		break;
+	    found = FALSE;
+	}
+    }
+
+    i_free(cursor);
+    return ret < 0 ? -1 : 0;
+}
+
+int signature_log_shared_lookup(struct dict *dict, const char *key,
+	unsigned int shards, long long *value_r)
+{
+    const char *value;
+    unsigned int i;
+    int ret, found = 0;
+
+    *value_r = 0;
+
+    for (i = 0; i < shards; i++)
+    {
+	T_BEGIN
+	{
+	    ret = dict_lookup(dict, unsafe_data_stack_pool,
+		    t_strdup_printf(SIGLOG_SHARD_KEY, key, i), &value);
+	    if (ret > 0)
+		*value_r += strtoll(value, NULL, 10);
+	}
+	T_END;
+
+	if (ret < 0)
+	    return -1;
+	if (ret > 0)
+	    found = 1;
+    }
+
+    return found;
+}
+
+int signature_log_shared_iterate(struct dict *dict, unsigned int shards,
+	signature_log_drain_callback_t *callback, void *context)
+{
+    struct dict_iterate_context *iter;
+    const char *key, *value, *slash;
+    string_t *name;
+    unsigned long shard;
+    long long sum = 0;
+    char *end;
+
+    name = str_new(default_pool, 64);
+
+    /*
+     * The md5 keys all have the same length, so sorted by key the shards
+     * of a counter come one after another.
+     */
+    iter = dict_iterate_init(dict, SIGLOG_SHARED_MD5_PREFIX,
+	    DICT_ITERATE_FLAG_RECURSE | DICT_ITERATE_FLAG_SORT_BY_KEY);
+    while (dict_iterate(iter, &key, &value))
+    {
+	key += strlen(DICT_PATH_SHARED);
+	slash = strrchr(key, '/');
+	if (slash == NULL)
+	    continue;
+	shard = strtoul(slash + 1, &end, 10);
+	if (*end != '\0' || end == slash + 1 || shard >= shards)
+	    continue;
+
+	if (str_len(name) != (size_t) (slash - key)
+		|| strncmp(str_c(name), key, slash - key) != 0)
+	{
+	    if (str_len(name) > 0)
+		callback(str_c(name), sum, context);
+	    str_truncate(name, 0);
+	    str_append_n(name, key, slash - key);
+	    sum = 0;
+	}
+	sum += strtoll(value, NULL, 10);
+    }
+    if (str_len(name) > 0)
+	callback(str_c(name), sum, context);
+
+    str_free(&name);
+    return dict_iterate_deinit(&iter) < 0 ? -1 : 0;
+}
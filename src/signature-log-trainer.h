@@ -0,0 +1,63 @@
+#ifndef ANTISPAM_SIGNATURE_LOG_TRAINER_H
+#define ANTISPAM_SIGNATURE_LOG_TRAINER_H
+
+#include "lib.h"
+#include "dict.h"
+
+/*
+ * Trainer side of antispam_siglog_generations, which only needs a dict and
+ * is linked into antispam-siglog-drain as well as the plugin. The plugin
+ * writes the counters of a user as <prefix><generation>/<key>, into the
+ * generation named by the counter at SIGLOG_GENERATION_KEY.
+ */
+#define SIGLOG_GENERATION_KEY DICT_PATH_PRIVATE "generation"
+#define SIGLOG_GEN_PREFIX DICT_PATH_PRIVATE "gen/"
+
+/*
+ * The shared counters of antispam_siglog_shards, shared/<key>/<shard> with
+ * <key> like the private counters without DICT_PATH_PRIVATE.
+ */
+#define SIGLOG_SHARD_KEY DICT_PATH_SHARED "%s/%u"
+#define SIGLOG_SHARED_MD5_PREFIX DICT_PATH_SHARED "md5/"
+
+/* Looks the generation the writers are in up, 0 if there is none yet. */
+int signature_log_generation_lookup(struct dict *dict,
+	unsigned int *generation_r);
+
+/*
+ * Advancing moves the writers on to a new generation and returns the one
+ * they left; give the writers that looked the generation up just before a
+ * moment to commit before draining it.
+ */
+int signature_log_generation_advance(struct dict *dict,
+	unsigned int *frozen_r);
+
+/*
+ * Draining passes the counters of the given generation and of all older
+ * ones to callback, with the keys relative to their generation, and takes
+ * the values passed off the counters, batch_size keys at a time. The
+ * counters are scanned again until a scan finds nothing left, so that what
+ * a slow writer still adds to a drained generation is passed as well, by
+ * this drain or the next one. A counter may be passed again if taking its
+ * value off fails.
+ */
+typedef void signature_log_drain_callback_t(const char *key,
+	long long value, void *context);
+
+int signature_log_generation_drain(struct dict *dict, unsigned int generation,
+	unsigned int batch_size, signature_log_drain_callback_t *callback,
+	void *context);
+
+/*
+ * Readers of antispam_siglog_shards, which sum up the shards 0 to
+ * shards - 1 of a shared counter. The lookup returns 1 if any of the
+ * shards exists, 0 if none and -1 on error. The iteration passes every
+ * md5 counter to callback once, with its key relative to DICT_PATH_SHARED
+ * and the sum of its shards.
+ */
+int signature_log_shared_lookup(struct dict *dict, const char *key,
+	unsigned int shards, long long *value_r);
+int signature_log_shared_iterate(struct dict *dict, unsigned int shards,
+	signature_log_drain_callback_t *callback, void *context);
+
+#endif
@@ -19,31 +19,76 @@
  */
 
 /*
- * A training implementation must still be written, it needs, to be atomic,
- * use transactions to get a list of all values and delete them at the same
- * time, or use a temporary table that is copied from the original while the
- * original is emptied (again, atomically)
+ * The training side reads the values and deletes them. To do that without
+ * racing the plugin, antispam_siglog_generations makes the plugin write
+ * into the generation named by a counter in the dict. The trainer moves
+ * the writers on and then drains the generation they left, see
+ * signature-log-trainer.h and antispam-siglog-drain.
  */
 
 /*
- * We really should have a global transaction as implemented
- * by the code that is commented out with C99 comments (//).
- * However, this breaks because
- * (1) sqlite cannot nest transactions
- * (2) the dict proxy keeps only a single connection open
- * (3) we here have a transaction per mailbox which makes two
- *     when moving messages (we might be able to hack around
- *     this but it's not trivial)
+ * The increments of a transaction are collected and written with a single
+ * dict transaction when it is committed, so no dict transaction is open
+ * while others may be (sqlite cannot nest them and the dict proxy keeps
+ * only a single connection open). There is a transaction per mailbox,
+ * which makes two when moving messages, unless antispam_batch is set.
  */
 
+#include <unistd.h>
+
 #include "lib.h"
+#include "array.h"
+#include "str.h"
 #include "dict.h"
+#include "md5.h"
+#include "ioloop.h"
 
 #include "aux.h"
+#include "lmdb-store.h"
 #include "signature-log.h"
+#include "signature-log-trainer.h"
 #include "signature.h"
+#include "strmap.h"
 #include "user.h"
 
+// pending keys that make a write-behind flush early
+#define SIGLOG_DEFAULT_FLUSH_KEYS 1000
+// maximum size of the LMDB file, in megabytes
+#define SIGLOG_DEFAULT_LMDB_SIZE 64
+
+// keys of antispam_siglog_key_format = md5
+#define SIGLOG_MD5_PREFIX DICT_PATH_PRIVATE "md5/"
+#define SIGLOG_NAME_PREFIX DICT_PATH_PRIVATE "name/"
+
+/*
+ * Bookkeeping of antispam_siglog_ttl. It is kept apart from the counters
+ * so that a trainer reading priv/ can tell them apart: the signatures are
+ * not expected to start with a dot.
+ */
+#define SIGLOG_META_PREFIX DICT_PATH_PRIVATE ".siglog/"
+#define SIGLOG_TIME_PREFIX SIGLOG_META_PREFIX "time/"
+#define SIGLOG_SWEEP_KEY SIGLOG_META_PREFIX "sweep"
+#define SIGLOG_CURSOR_KEY SIGLOG_META_PREFIX "sweep-cursor"
+// set once antispam_siglog_key_migrate moved all the raw keys
+#define SIGLOG_MIGRATED_KEY SIGLOG_META_PREFIX "migrated"
+#define SIGLOG_DEFAULT_SWEEP_INTERVAL (24 * 3600)
+#define SIGLOG_DEFAULT_SWEEP_BATCH 100
+#define SIGLOG_DEFAULT_SWEEP_SCAN 1000
+// pause between two steps of a sweep
+#define SIGLOG_SWEEP_STEP_MSECS 1000
+
+/*
+ * Shared counters of antispam_siglog_shards, see SIGLOG_SHARD_KEY. Every
+ * user (or process) increments one of the shards only, so a campaign
+ * hitting many mailboxes doesn't make a single hot key.
+ */
+#define SIGLOG_SHARED_NAME_PREFIX DICT_PATH_SHARED "name/"
+
+enum siglog_key_format
+{
+    SIGLOG_KEY_RAW,		// the signature itself
+    SIGLOG_KEY_MD5,		// its md5 in url-safe base64
+};
 
 struct signature_log_config
 {
@@ -51,12 +96,112 @@ struct signature_log_config
     const char *dict_uri;
     const char *dict_user;
     void *sig_data;
+
+    bool async;
+
+    enum siglog_key_format key_format;
+    bool key_names;		// keep the signatures of the md5 keys
+    bool key_migrate;		// move the raw keys into the md5 ones
+    bool generations;
+    unsigned int shards;	// 0 = private counters
+    unsigned int shard;		// the one this user writes to
+
+    // expiry, see signature_log_sweep()
+    unsigned int ttl;		// days, 0 = never
+    unsigned int sweep_interval;
+    unsigned int sweep_batch;
+    unsigned int sweep_scan;	// timestamps looked at per step
+    time_t next_sweep;
+    struct timeout *sweep_to;
+    bool sweeping;
+    char *sweep_cursor;		// last timestamp looked at, NULL from start
+    unsigned int swept;		// counters removed by this sweep
+
+    // see signature_log_migrate_walk()
+    struct timeout *migrate_to;
+    bool migrate_started;
+    char *migrate_cursor;	// last key looked at, NULL from start
+
+    // write-behind, see signature_log_merge()
+    unsigned int flush_interval;	// seconds, 0 = write at every commit
+    unsigned int flush_keys;
+    struct signature_log_transaction_context *pending;
+    struct timeout *flush_to;
+
+    // opened on first use and kept until the user is deinitialized
+    struct dict *dict;
+    bool dict_failed;		// by an async commit, reopen it
+
+#ifdef HAVE_LMDB
+    // used instead of the dict if set
+    struct lmdb_store *lmdb;
+#endif
 };
 
+/*
+ * Drops the connection after an error so that the next transaction opens
+ * a fresh one instead of failing on a broken one.
+ */
+static void signature_log_drop_dict(struct mail_user *user)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+
+    cfg->dict_failed = FALSE;
+    if (cfg->dict == NULL)
+	return;
+
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    dict_wait(cfg->dict);
+#endif
+    dict_deinit(&cfg->dict);
+}
+
+static struct dict *signature_log_open_dict(struct mail_user *user)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+
+    if (cfg->dict_failed)
+	signature_log_drop_dict(user);
+
+    if (cfg->dict != NULL)
+    {
+	asu->stats.dict_reuses++;
+	return cfg->dict;
+    }
+
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    if (dict_init(cfg->dict_uri, DICT_DATA_TYPE_STRING, cfg->dict_user,
+		cfg->base_dir, &cfg->dict, NULL))
+	cfg->dict = NULL;
+#else
+    cfg->dict =
+           dict_init(cfg->dict_uri, DICT_DATA_TYPE_STRING, cfg->dict_user,
+           cfg->base_dir);
+#endif
+
+    if (cfg->dict != NULL)
+	asu->stats.dict_connects++;
+
+    return cfg->dict;
+}
+
+static unsigned int signature_log_shard_hash(const char *str)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *str != '\0'; str++)
+	hash = (hash ^ (unsigned char) *str) * 16777619U;
+
+    return hash;
+}
+
 bool signature_log_init(struct mail_user *user, void **data)
 {
     struct signature_log_config *cfg =
 	    p_new(user->pool, struct signature_log_config, 1);
+    const char *lmdb_path;
     const char *tmp;
 
     if (cfg == NULL)
@@ -64,21 +209,151 @@ bool signature_log_init(struct mail_user *user, void **data)
 
     cfg->base_dir = mail_user_plugin_getenv(user, "base_dir");
 
-    tmp = config(user, "siglog_dict_uri");
-    if (EMPTY_STR(tmp))
+    lmdb_path = config(user, "siglog_lmdb_path");
+    if (EMPTY_STR(lmdb_path))
     {
-	i_debug("empty siglog_dict_uri");
+	lmdb_path = NULL;
+
+	tmp = config(user, "siglog_dict_uri");
+	if (EMPTY_STR(tmp))
+	{
+	    i_debug("empty siglog_dict_uri");
+	    goto bailout;
+	}
+	cfg->dict_uri = tmp;
+
+	tmp = config(user, "siglog_dict_user");
+	if (EMPTY_STR(tmp))
+	{
+	    i_debug("empty siglog_dict_user");
+	    goto bailout;
+	}
+	cfg->dict_user = tmp;
+    }
+
+    tmp = config(user, "siglog_key_format");
+    if (EMPTY_STR(tmp) || strcasecmp(tmp, "raw") == 0)
+	cfg->key_format = SIGLOG_KEY_RAW;
+    else if (strcasecmp(tmp, "md5") == 0)
+    {
+	cfg->key_format = SIGLOG_KEY_MD5;
+
+	tmp = config(user, "siglog_key_names");
+	if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	    cfg->key_names = TRUE;
+
+	tmp = config(user, "siglog_key_migrate");
+	if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	    cfg->key_migrate = TRUE;
+    }
+    else
+    {
+	i_debug("invalid siglog_key_format");
+	goto bailout;
+    }
+
+    tmp = config(user, "siglog_ttl");
+    if (!EMPTY_STR(tmp) && str_to_uint(tmp, &cfg->ttl) < 0)
+    {
+	i_debug("invalid siglog_ttl");
+	goto bailout;
+    }
+
+    cfg->sweep_interval = SIGLOG_DEFAULT_SWEEP_INTERVAL;
+    tmp = config(user, "siglog_sweep_interval");
+    if (!EMPTY_STR(tmp) && str_to_uint(tmp, &cfg->sweep_interval) < 0)
+    {
+	i_debug("invalid siglog_sweep_interval");
+	goto bailout;
+    }
+
+    cfg->sweep_batch = SIGLOG_DEFAULT_SWEEP_BATCH;
+    tmp = config(user, "siglog_sweep_batch");
+    if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &cfg->sweep_batch) < 0
+		|| cfg->sweep_batch == 0))
+    {
+	i_debug("invalid siglog_sweep_batch");
+	goto bailout;
+    }
+
+    cfg->sweep_scan = SIGLOG_DEFAULT_SWEEP_SCAN;
+    tmp = config(user, "siglog_sweep_scan");
+    if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &cfg->sweep_scan) < 0
+		|| cfg->sweep_scan == 0))
+    {
+	i_debug("invalid siglog_sweep_scan");
 	goto bailout;
     }
-    cfg->dict_uri = tmp;
 
-    tmp = config(user, "siglog_dict_user");
-    if (EMPTY_STR(tmp))
+    tmp = config(user, "siglog_generations");
+    if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
     {
-	i_debug("empty siglog_dict_user");
+	// drained generations are gone anyway
+	if (cfg->ttl > 0)
+	{
+	    i_debug("siglog_ttl can't be used with siglog_generations");
+	    goto bailout;
+	}
+	cfg->generations = TRUE;
+    }
+
+    tmp = config(user, "siglog_shards");
+    if (!EMPTY_STR(tmp) && str_to_uint(tmp, &cfg->shards) < 0)
+    {
+	i_debug("invalid siglog_shards");
+	goto bailout;
+    }
+
+    if (cfg->shards > 0)
+    {
+	// they are per user
+	if (cfg->ttl > 0 || cfg->generations)
+	{
+	    i_debug("siglog_shards can't be used with siglog_ttl "
+		    "or siglog_generations");
+	    goto bailout;
+	}
+
+	// the raw counts are per user, the shards are not
+	if (cfg->key_migrate)
+	{
+	    i_debug("siglog_shards can't be used with siglog_key_migrate");
+	    goto bailout;
+	}
+
+	tmp = config(user, "siglog_shard_by");
+	if (EMPTY_STR(tmp) || strcasecmp(tmp, "user") == 0)
+	    cfg->shard = signature_log_shard_hash(user->username) % cfg->shards;
+	else if (strcasecmp(tmp, "process") == 0)
+	    cfg->shard = getpid() % cfg->shards;
+	else
+	{
+	    i_debug("invalid siglog_shard_by");
+	    goto bailout;
+	}
+    }
+
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    tmp = config(user, "siglog_async");
+    if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	cfg->async = TRUE;
+#endif
+
+    tmp = config(user, "siglog_flush_interval");
+    if (!EMPTY_STR(tmp) && str_to_uint(tmp, &cfg->flush_interval) < 0)
+    {
+	i_debug("invalid siglog_flush_interval");
+	goto bailout;
+    }
+
+    cfg->flush_keys = SIGLOG_DEFAULT_FLUSH_KEYS;
+    tmp = config(user, "siglog_flush_keys");
+    if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &cfg->flush_keys) < 0
+		|| cfg->flush_keys == 0))
+    {
+	i_debug("invalid siglog_flush_keys");
 	goto bailout;
     }
-    cfg->dict_user = tmp;
 
     if (signature_init(user, &cfg->sig_data) == FALSE)
     {
@@ -86,6 +361,43 @@ bool signature_log_init(struct mail_user *user, void **data)
 	goto bailout;
     }
 
+    if (lmdb_path != NULL)
+    {
+	// the store has no timestamps to sweep by
+	if (cfg->ttl > 0)
+	{
+	    i_debug("siglog_ttl can't be used with siglog_lmdb_path");
+	    goto bailout;
+	}
+
+	// nor generations, the trainer can't drain it
+	if (cfg->generations)
+	{
+	    i_debug("siglog_generations can't be used with "
+		    "siglog_lmdb_path");
+	    goto bailout;
+	}
+
+#ifdef HAVE_LMDB
+	unsigned int lmdb_size = SIGLOG_DEFAULT_LMDB_SIZE;
+
+	tmp = config(user, "siglog_lmdb_size");
+	if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &lmdb_size) < 0
+		    || lmdb_size == 0))
+	{
+	    i_debug("invalid siglog_lmdb_size");
+	    goto bailout;
+	}
+
+	cfg->lmdb = lmdb_store_open(lmdb_path, (size_t) lmdb_size << 20);
+	if (cfg->lmdb == NULL)
+	    goto bailout;
+#else
+	i_debug("siglog_lmdb_path set, but built without LMDB support");
+	goto bailout;
+#endif
+    }
+
     *data = cfg;
 
     return TRUE;
@@ -97,68 +409,816 @@ fail:
     return FALSE;
 }
 
+struct signature_log_delta
+{
+    const char *key;
+    const char *signature;	// of md5 keys only
+    long long delta;
+};
+ARRAY_DEFINE_TYPE(signature_log_delta, struct signature_log_delta);
+
+/*
+ * The increments are collected per key while the transaction runs and
+ * written in one dict transaction when it is committed.
+ */
 struct signature_log_transaction_context
 {
+    struct mail_user *user;	// whose config holds the dict
+    pool_t pool;
+    ARRAY_TYPE(signature_log_delta) deltas;
+    struct strmap *index;	// key -> index in deltas + 1
+
+    const char *generation;	// key prefix of the generation written to
+};
+
+static void signature_log_free(struct signature_log_transaction_context
+	**_sltc)
+{
+    struct signature_log_transaction_context *sltc = *_sltc;
+
+    *_sltc = NULL;
+    pool_unref(&sltc->pool);
+    i_free(sltc);
+}
+
+static struct signature_log_transaction_context *
+signature_log_create(struct mail_user *user)
+{
+    struct signature_log_transaction_context *sltc =
+	    i_new(struct signature_log_transaction_context, 1);
+
+    sltc->user = user;
+    sltc->pool = pool_alloconly_create("signature-log keys", 1024);
+    p_array_init(&sltc->deltas, sltc->pool, 32);
+    sltc->index = strmap_create(sltc->pool, 32);
+
+    return sltc;
+}
+
+static void signature_log_add_key(struct signature_log_transaction_context
+	*sltc, const char *key, const char *signature, long long value)
+{
+    struct signature_log_delta *delta;
+    void *idx;
+
+    if (strmap_lookup(sltc->index, key, &idx))
+	delta = array_idx_modifiable(&sltc->deltas,
+		POINTER_CAST_TO(idx, unsigned int) - 1);
+    else
+    {
+	delta = array_append_space(&sltc->deltas);
+	delta->key = p_strdup(sltc->pool, key);
+	delta->signature = p_strdup(sltc->pool, signature);
+	strmap_insert(sltc->index, delta->key,
+		POINTER_CAST(array_count(&sltc->deltas)));
+    }
+
+    delta->delta += value;
+}
+
+/* Returns the md5 of the signature in url-safe base64 without padding. */
+static const char *signature_log_hash(const char *signature)
+{
+    static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned char digest[MD5_RESULTLEN];
+    string_t *str = t_str_new(MD5_RESULTLEN * 4 / 3 + 1);
+    unsigned int i, bits = 0, nbits = 0;
+
+    md5_get_digest(signature, strlen(signature), digest);
+
+    for (i = 0; i < MD5_RESULTLEN; i++)
+    {
+	bits = (bits << 8) | digest[i];
+	nbits += 8;
+
+	while (nbits >= 6)
+	{
+	    nbits -= 6;
+	    str_append_c(str, b64[(bits >> nbits) & 63]);
+	}
+    }
+
+    if (nbits > 0)
+	str_append_c(str, b64[(bits << (6 - nbits)) & 63]);
+
+    return str_c(str);
+}
+
+static void signature_log_add(struct signature_log_transaction_context *sltc,
+	const char *signature, bool spam)
+{
+    struct antispam_user *asu = USER_CONTEXT(sltc->user);
+    struct signature_log_config *cfg = asu->backend_config;
+
+    T_BEGIN
+    {
+	if (cfg->key_format == SIGLOG_KEY_MD5)
+	    signature_log_add_key(sltc,
+		    t_strconcat(SIGLOG_MD5_PREFIX,
+			    signature_log_hash(signature), NULL),
+		    signature, spam ? 1 : -1);
+	else
+	    signature_log_add_key(sltc,
+		    t_strconcat(DICT_PATH_PRIVATE, signature, NULL),
+		    NULL, spam ? 1 : -1);
+    }
+    T_END;
+}
+
+/*
+ * Compat reader for the raw keys written before switching to md5 ones:
+ * adds their values to the deltas of the md5 keys and removes them in the
+ * same transaction.
+ */
+static void signature_log_migrate(struct dict *dict,
+	struct dict_transaction_context *ctx,
+	struct signature_log_transaction_context *sltc)
+{
+    struct signature_log_delta *delta;
+
+    array_foreach_modifiable(&sltc->deltas, delta)
+    {
+	if (delta->signature == NULL)
+	    continue;
+
+	T_BEGIN
+	{
+	    const char *raw = t_strconcat(DICT_PATH_PRIVATE, delta->signature,
+		    NULL);
+	    const char *value;
+
+	    if (dict_lookup(dict, unsafe_data_stack_pool, raw, &value) > 0)
+	    {
+		delta->delta += strtoll(value, NULL, 10);
+		dict_unset(ctx, raw);
+	    }
+	}
+	T_END;
+    }
+}
+
+/*
+ * Returns the dict key of a counter, in the generation written to or in
+ * the shard of the user.
+ */
+static const char *signature_log_dict_key(const struct
+	signature_log_transaction_context *sltc,
+	const struct signature_log_delta *delta)
+{
+    struct antispam_user *asu = USER_CONTEXT(sltc->user);
+    struct signature_log_config *cfg = asu->backend_config;
+    const char *name = delta->key + strlen(DICT_PATH_PRIVATE);
+
+    if (cfg->shards > 0)
+	return t_strdup_printf(SIGLOG_SHARD_KEY, name, cfg->shard);
+
+    if (sltc->generation != NULL)
+	return t_strconcat(sltc->generation, name, NULL);
+
+    return delta->key;
+}
+
+static void signature_log_commit_callback(int ret, void *context)
+{
+    struct signature_log_transaction_context *sltc = context;
+    struct antispam_user *asu = USER_CONTEXT(sltc->user);
+    struct signature_log_config *cfg = asu->backend_config;
+
+    // 0: the existing keys were incremented, the connection is fine
+    if (ret == 0)
+	i_error("antispam: the dict driver didn't create missing signature "
+		"keys on increment, their counts are lost");
+    else if (ret < 0)
+    {
+	i_error("antispam: failed to log %u signature counts",
+		array_count(&sltc->deltas));
+	cfg->dict_failed = TRUE;
+    }
+
+    signature_log_free(&sltc);
+}
+
+/* Unsets the counter of a timestamp key and what belongs to it. */
+static void signature_log_unset_counter(struct dict_transaction_context *ctx,
+	const char *time_key)
+{
+    const char *name = time_key + strlen(SIGLOG_TIME_PREFIX);
+
+    dict_unset(ctx, time_key);
+    dict_unset(ctx, t_strconcat(DICT_PATH_PRIVATE, name, NULL));
+
+    if (strncmp(name, "md5/", 4) == 0)
+	dict_unset(ctx, t_strconcat(SIGLOG_NAME_PREFIX, name + 4, NULL));
+}
+
+/*
+ * Begins a sweep unless another session of the user did one lately, in
+ * which case the next one is put off. The sweep resumes where the last one
+ * was cut short.
+ */
+static bool signature_log_sweep_begin(struct mail_user *user,
+	struct dict *dict)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+    struct dict_transaction_context *ctx;
+    const char *value;
+    long last;
+
+    T_BEGIN
+    {
+	if (dict_lookup(dict, unsafe_data_stack_pool, SIGLOG_SWEEP_KEY,
+		    &value) > 0
+		&& (last = strtol(value, NULL, 10)) + cfg->sweep_interval
+			> ioloop_time)
+	{
+	    // another session did it
+	    cfg->next_sweep = last + cfg->sweep_interval;
+	}
+	else
+	{
+	    ctx = dict_transaction_begin(dict);
+	    dict_set(ctx, SIGLOG_SWEEP_KEY,
+		    t_strdup_printf("%ld", (long) ioloop_time));
+	    if (dict_transaction_commit(&ctx) >= 0)
+	    {
+		cfg->sweeping = TRUE;
+		cfg->swept = 0;
+
+		i_free(cfg->sweep_cursor);
+		if (dict_lookup(dict, unsafe_data_stack_pool,
+			    SIGLOG_CURSOR_KEY, &value) > 0)
+		    cfg->sweep_cursor = i_strdup(value);
+	    }
+	}
+    }
+    T_END;
+
+    return cfg->sweeping;
+}
+
+/*
+ * Looks at the next sweep_scan timestamps in key order and removes the
+ * expired counters among them sweep_batch at a time, each batch in its own
+ * dict transaction. Returns 1 if the sweep is done, 0 if there is more to
+ * look at, -1 on error.
+ */
+static int signature_log_sweep_step(struct mail_user *user, struct dict *dict)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+    struct dict_iterate_context *iter;
+    struct dict_transaction_context *ctx;
+    ARRAY_TYPE(const_string) expired;
+    const char *key, *value, *last = NULL, *const *keys;
+    time_t limit = ioloop_time - (time_t) cfg->ttl * 24 * 3600;
+    unsigned int scanned = 0, i, count;
+    bool more = FALSE;
+
+    t_array_init(&expired, cfg->sweep_batch);
+
+    iter = dict_iterate_init(dict, SIGLOG_TIME_PREFIX,
+	    DICT_ITERATE_FLAG_RECURSE | DICT_ITERATE_FLAG_SORT_BY_KEY);
+    while (dict_iterate(iter, &key, &value))
+    {
+	// looked at by the steps before
+	if (cfg->sweep_cursor != NULL && strcmp(key, cfg->sweep_cursor) <= 0)
+	    continue;
+
+	if (scanned == cfg->sweep_scan)
+	{
+	    more = TRUE;
+	    break;
+	}
+	scanned++;
+
+	last = t_strdup(key);
+	if (strtol(value, NULL, 10) < limit)
+	    array_append(&expired, &last, 1);
+    }
+
+    if (dict_iterate_deinit(&iter) < 0)
+    {
+	i_error("antispam: failed to iterate signature timestamps");
+	return -1;
+    }
+
+    keys = array_get(&expired, &count);
+    for (i = 0; i < count;)
+    {
+	ctx = dict_transaction_begin(dict);
+	do
+	    signature_log_unset_counter(ctx, keys[i]);
+	while (++i < count && i % cfg->sweep_batch != 0);
+
+	if (dict_transaction_commit(&ctx) < 0)
+	{
+	    i_error("antispam: failed to remove expired signatures");
+	    return -1;
+	}
+    }
+    cfg->swept += count;
+
+    ctx = dict_transaction_begin(dict);
+    if (more)
+	dict_set(ctx, SIGLOG_CURSOR_KEY, last);
+    else
+	dict_unset(ctx, SIGLOG_CURSOR_KEY);
+    if (dict_transaction_commit(&ctx) < 0)
+    {
+	i_error("antispam: failed to save the signature sweep position");
+	return -1;
+    }
+
+    i_free(cfg->sweep_cursor);
+    cfg->sweep_cursor = more ? i_strdup(last) : NULL;
+    return more ? 0 : 1;
+}
+
+/*
+ * Removes the counters that weren't touched for ttl days. The sweep runs
+ * from a timeout once the command that found it due is done, in steps of
+ * sweep_scan timestamps, so that neither the session nor the dict is
+ * stalled for long. Where the last step stopped is kept in the dict for a
+ * sweep that is cut short by a logout, as is the time of the last sweep so
+ * that it runs once per sweep_interval and user rather than once per
+ * session.
+ */
+static void signature_log_sweep(struct mail_user *user)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
     struct dict *dict;
-    struct dict_transaction_context *dict_ctx;
+    int ret;
+
+    timeout_remove(&cfg->sweep_to);
+
+    dict = signature_log_open_dict(user);
+    if (dict == NULL)
+    {
+	i_error("antispam: failed to initialise dict connection");
+	cfg->sweeping = FALSE;
+	return;
+    }
+
+    if (!cfg->sweeping && !signature_log_sweep_begin(user, dict))
+	return;
+
+    T_BEGIN
+    {
+	ret = signature_log_sweep_step(user, dict);
+    }
+    T_END;
+
+    if (ret == 0)
+    {
+	cfg->sweep_to = timeout_add(SIGLOG_SWEEP_STEP_MSECS,
+		signature_log_sweep, user);
+	return;
+    }
+
+    cfg->sweeping = FALSE;
+    if (ret > 0 && cfg->swept > 0 && user->mail_debug)
+	i_debug("antispam: removed %u expired signatures", cfg->swept);
+}
+
+struct signature_log_raw_key
+{
+    const char *key;
+    long long value;
 };
+ARRAY_DEFINE_TYPE(signature_log_raw_key, struct signature_log_raw_key);
 
-void *signature_log_transaction_begin(struct mailbox *box,
-	enum mailbox_transaction_flags flags ATTR_UNUSED)
+/* Returns TRUE if key is a raw counter, not one of the other keys. */
+static bool signature_log_is_raw_key(const char *key)
+{
+    const char *name = key + strlen(DICT_PATH_PRIVATE);
+
+    return strncmp(key, SIGLOG_MD5_PREFIX, strlen(SIGLOG_MD5_PREFIX)) != 0
+	    && strncmp(key, SIGLOG_NAME_PREFIX,
+		    strlen(SIGLOG_NAME_PREFIX)) != 0
+	    && strncmp(key, SIGLOG_META_PREFIX,
+		    strlen(SIGLOG_META_PREFIX)) != 0
+	    && strncmp(key, SIGLOG_GEN_PREFIX, strlen(SIGLOG_GEN_PREFIX)) != 0
+	    && strcmp(key, SIGLOG_GENERATION_KEY) != 0 && *name != '\0';
+}
+
+/*
+ * Moves the next raw keys after the cursor into the md5 ones, at most
+ * sweep_batch of them out of sweep_scan keys looked at, in one dict
+ * transaction. Returns 1 if the walk is done, 0 if there is more and -1
+ * on error.
+ */
+static int signature_log_migrate_step(struct mail_user *user,
+	struct dict *dict)
 {
-    struct signature_log_transaction_context *sltc = NULL;
-    struct antispam_user *asu = USER_CONTEXT(box->storage->user);
+    struct antispam_user *asu = USER_CONTEXT(user);
     struct signature_log_config *cfg = asu->backend_config;
+    struct dict_iterate_context *iter;
+    struct dict_transaction_context *ctx;
+    ARRAY_TYPE(signature_log_raw_key) raw;
+    const struct signature_log_raw_key *entry;
+    struct signature_log_raw_key *new_entry;
+    const char *key, *value, *last = NULL, *prefix = DICT_PATH_PRIVATE;
+    unsigned int scanned = 0, generation;
+    bool more = FALSE;
 
-    if (cfg == NULL)
-	return NULL;
+    // the raw keys go where the writes of the md5 ones go
+    if (cfg->generations)
+    {
+	if (signature_log_generation_lookup(dict, &generation) < 0)
+	    return -1;
+	prefix = t_strdup_printf(SIGLOG_GEN_PREFIX "%u/", generation);
+    }
 
-    sltc = i_new(struct signature_log_transaction_context, 1);
+    t_array_init(&raw, cfg->sweep_batch);
 
-    if (sltc == NULL)
-	return NULL;
+    iter = dict_iterate_init(dict, DICT_PATH_PRIVATE,
+	    DICT_ITERATE_FLAG_RECURSE | DICT_ITERATE_FLAG_SORT_BY_KEY);
+    while (dict_iterate(iter, &key, &value))
+    {
+	if (cfg->migrate_cursor != NULL
+		&& strcmp(key, cfg->migrate_cursor) <= 0)
+	    continue;
 
-#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
-    if (dict_init(cfg->dict_uri, DICT_DATA_TYPE_STRING, cfg->dict_user,
-		cfg->base_dir, &sltc->dict, NULL))
-#else
-    sltc->dict =
-           dict_init(cfg->dict_uri, DICT_DATA_TYPE_STRING, cfg->dict_user,
-           cfg->base_dir);
+	if (scanned == cfg->sweep_scan
+		|| array_count(&raw) == cfg->sweep_batch)
+	{
+	    more = TRUE;
+	    break;
+	}
+	scanned++;
+
+	last = t_strdup(key);
+	if (!signature_log_is_raw_key(key))
+	    continue;
+
+	new_entry = array_append_space(&raw);
+	new_entry->key = last;
+	new_entry->value = strtoll(value, NULL, 10);
+    }
+
+    if (dict_iterate_deinit(&iter) < 0)
+    {
+	i_error("antispam: failed to iterate the raw signature keys");
+	return -1;
+    }
+
+    ctx = dict_transaction_begin(dict);
+    array_foreach(&raw, entry)
+    {
+	const char *signature = entry->key + strlen(DICT_PATH_PRIVATE);
+	const char *hash = signature_log_hash(signature);
+
+	if (entry->value != 0)
+	    dict_atomic_inc(ctx, t_strconcat(prefix, "md5/", hash, NULL),
+		    entry->value);
+	// expires like a counter written now
+	if (cfg->ttl > 0)
+	    dict_set(ctx, t_strconcat(SIGLOG_TIME_PREFIX, "md5/", hash, NULL),
+		    t_strdup_printf("%ld", (long) ioloop_time));
+	if (cfg->key_names)
+	    dict_set(ctx, t_strconcat(SIGLOG_NAME_PREFIX, hash, NULL),
+		    signature);
+	dict_unset(ctx, entry->key);
+    }
+    if (!more)
+	dict_set(ctx, SIGLOG_MIGRATED_KEY, "1");
+
+    if (dict_transaction_commit(&ctx) < 0)
+    {
+	i_error("antispam: failed to migrate the raw signature keys");
+	return -1;
+    }
+
+    i_free(cfg->migrate_cursor);
+    cfg->migrate_cursor = more ? i_strdup(last) : NULL;
+    return more ? 0 : 1;
+}
+
+/*
+ * One-shot walk of antispam_siglog_key_migrate: moves all the raw keys of
+ * the user into the md5 ones, written again or not, so that readers only
+ * need to look at the md5 keys once it is done. It runs in steps from a
+ * timeout like the sweep, see signature_log_sweep(), and leaves a marker in
+ * the dict when done, after which signature_log_migrate() is skipped too.
+ */
+static void signature_log_migrate_walk(struct mail_user *user)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+    struct dict *dict;
+    const char *value;
+    int ret;
+
+    timeout_remove(&cfg->migrate_to);
+
+    dict = signature_log_open_dict(user);
+    if (dict == NULL)
+    {
+	i_error("antispam: failed to initialise dict connection");
+	return;
+    }
 
-    if (sltc->dict == NULL)
+    T_BEGIN
+    {
+	if (cfg->migrate_cursor == NULL && dict_lookup(dict,
+		    unsafe_data_stack_pool, SIGLOG_MIGRATED_KEY, &value) > 0)
+	    ret = 1;
+	else
+	    ret = signature_log_migrate_step(user, dict);
+    }
+    T_END;
+
+    if (ret == 0)
+	cfg->migrate_to = timeout_add(SIGLOG_SWEEP_STEP_MSECS,
+		signature_log_migrate_walk, user);
+    else if (ret > 0)
+	cfg->key_migrate = FALSE;
+}
+
+#ifdef HAVE_LMDB
+static int signature_log_write_lmdb(struct lmdb_store *store,
+	struct signature_log_transaction_context *sltc)
+{
+    struct antispam_user *asu = USER_CONTEXT(sltc->user);
+    struct signature_log_config *cfg = asu->backend_config;
+    struct signature_log_delta *delta;
+    long long value;
+    int ret = 0;
+
+    if (lmdb_store_begin(store) < 0)
+	return -1;
+
+    array_foreach_modifiable(&sltc->deltas, delta)
+    {
+	// raw key of the signature to migrate, see signature_log_migrate()
+	if (cfg->key_migrate && delta->signature != NULL)
+	{
+	    T_BEGIN
+	    {
+		const char *raw = t_strconcat(DICT_PATH_PRIVATE,
+			delta->signature, NULL);
+
+		ret = lmdb_store_lookup(store, raw, &value);
+		if (ret > 0)
+		{
+		    delta->delta += value;
+		    ret = lmdb_store_unset(store, raw);
+		}
+	    }
+	    T_END;
+	}
+
+	if (ret == 0 && delta->delta != 0)
+	    ret = lmdb_store_inc(store, delta->key, delta->delta);
+
+	if (ret < 0)
+	{
+	    lmdb_store_rollback(store);
+	    return -1;
+	}
+    }
+
+    return lmdb_store_commit(store);
+}
 #endif
+
+/*
+ * Writes the collected increments with one dict transaction and frees
+ * them, when the commit is finished in the async case.
+ */
+static int signature_log_write(struct signature_log_transaction_context
+	**_sltc)
+{
+    struct signature_log_transaction_context *sltc = *_sltc;
+    struct mail_user *user = sltc->user;
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+    const struct signature_log_delta *delta;
+    struct dict_transaction_context *ctx;
+    struct dict *dict;
+    int ret;
+
+    *_sltc = NULL;
+
+    if (array_count(&sltc->deltas) == 0)
     {
-	i_free(sltc);
-	return NULL;
+	signature_log_free(&sltc);
+	return 0;
+    }
+
+#ifdef HAVE_LMDB
+    if (cfg->lmdb != NULL)
+    {
+	ret = signature_log_write_lmdb(cfg->lmdb, sltc);
+	signature_log_free(&sltc);
+	return ret;
     }
+#endif
 
-    //sltc->dict_ctx = dict_transaction_begin(sltc->dict); // see comment above
+    dict = signature_log_open_dict(user);
+    if (dict == NULL)
+    {
+	i_error("antispam: failed to initialise dict connection");
+	signature_log_free(&sltc);
+	return -1;
+    }
 
-    return sltc;
+    // the sweep is left to a timeout, see signature_log_sweep()
+    if (cfg->ttl > 0 && !cfg->sweeping && cfg->sweep_to == NULL
+	    && ioloop_time >= cfg->next_sweep && current_ioloop != NULL)
+    {
+	cfg->next_sweep = ioloop_time + cfg->sweep_interval;
+	cfg->sweep_to = timeout_add(0, signature_log_sweep, user);
+    }
+
+    // the walk is left to a timeout, see signature_log_migrate_walk()
+    if (cfg->key_migrate && !cfg->migrate_started && current_ioloop != NULL)
+    {
+	cfg->migrate_started = TRUE;
+	cfg->migrate_to = timeout_add(0, signature_log_migrate_walk, user);
+    }
+
+    if (cfg->generations)
+    {
+	unsigned int generation;
+
+	if (signature_log_generation_lookup(dict, &generation) < 0)
+	{
+	    i_error("antispam: failed to look up the signature generation");
+	    signature_log_free(&sltc);
+	    signature_log_drop_dict(user);
+	    return -1;
+	}
+
+	sltc->generation = p_strdup_printf(sltc->pool,
+		SIGLOG_GEN_PREFIX "%u/", generation);
+    }
+
+    ctx = dict_transaction_begin(dict);
+    if (cfg->key_migrate)
+	signature_log_migrate(dict, ctx, sltc);
+
+    array_foreach(&sltc->deltas, delta)
+    {
+	// moved to spam and back, nothing to write
+	if (delta->delta == 0)
+	    continue;
+
+	T_BEGIN
+	{
+	    dict_atomic_inc(ctx, signature_log_dict_key(sltc, delta),
+		    delta->delta);
+	}
+	T_END;
+
+	if (cfg->ttl > 0)
+	{
+	    T_BEGIN
+	    {
+		dict_set(ctx, t_strconcat(SIGLOG_TIME_PREFIX,
+			delta->key + strlen(DICT_PATH_PRIVATE), NULL),
+			t_strdup_printf("%ld", (long) ioloop_time));
+	    }
+	    T_END;
+	}
+
+	if (cfg->key_names && delta->signature != NULL)
+	{
+	    T_BEGIN
+	    {
+		dict_set(ctx, t_strconcat(cfg->shards > 0
+			? SIGLOG_SHARED_NAME_PREFIX : SIGLOG_NAME_PREFIX,
+			delta->key + strlen(SIGLOG_MD5_PREFIX), NULL),
+			delta->signature);
+	    }
+	    T_END;
+	}
+    }
+
+    if (cfg->async)
+    {
+	dict_transaction_commit_async(&ctx, signature_log_commit_callback,
+		sltc);
+	return 0;
+    }
+
+    /*
+     * 0 means that the driver only increments existing keys (SQL). Those
+     * were committed, failing the command would make a retry count them
+     * twice.
+     */
+    ret = dict_transaction_commit(&ctx);
+    if (ret == 0)
+	i_error("antispam: the dict driver didn't create missing signature "
+		"keys on increment, their counts are lost");
+    signature_log_free(&sltc);
+
+    if (ret < 0)
+    {
+	signature_log_drop_dict(user);
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Writes out what the write-behind collected so far. */
+static void signature_log_flush(struct mail_user *user)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    struct signature_log_config *cfg = asu->backend_config;
+
+    if (cfg->flush_to != NULL)
+	timeout_remove(&cfg->flush_to);
+
+    if (cfg->pending == NULL)
+	return;
+
+    if (signature_log_write(&cfg->pending) < 0)
+	i_error("antispam: failed to write the pending signature counts");
+}
+
+/*
+ * Write-behind: sums the increments of the committed transactions up in
+ * the process and writes them once the oldest is flush_interval seconds
+ * old or flush_keys keys are pending, so a crash loses at most one
+ * interval of counts.
+ */
+static void signature_log_merge(struct signature_log_transaction_context
+	**_sltc)
+{
+    struct signature_log_transaction_context *sltc = *_sltc;
+    struct antispam_user *asu = USER_CONTEXT(sltc->user);
+    struct signature_log_config *cfg = asu->backend_config;
+    const struct signature_log_delta *delta;
+
+    *_sltc = NULL;
+
+    if (cfg->pending == NULL)
+    {
+	cfg->pending = signature_log_create(sltc->user);
+	cfg->flush_to = timeout_add(cfg->flush_interval * 1000,
+		signature_log_flush, sltc->user);
+    }
+
+    array_foreach(&sltc->deltas, delta)
+	signature_log_add_key(cfg->pending, delta->key, delta->signature,
+		delta->delta);
+
+    if (array_count(&cfg->pending->deltas) >= cfg->flush_keys)
+	signature_log_flush(sltc->user);
+
+    signature_log_free(&sltc);
+}
+
+const char *const *signature_log_wanted_headers(void *data)
+{
+    struct signature_log_config *cfg = data;
+
+    return signature_wanted_headers(cfg->sig_data);
+}
+
+void *signature_log_transaction_begin(struct mail_storage *storage,
+	enum mailbox_transaction_flags flags ATTR_UNUSED)
+{
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+
+    if (asu->backend_config == NULL)
+	return NULL;
+
+    return signature_log_create(storage->user);
 }
 
-int signature_log_transaction_commit(struct mailbox *box ATTR_UNUSED,
+int signature_log_transaction_commit(struct mail_storage *storage,
 	void *data)
 {
     struct signature_log_transaction_context *sltc = data;
-    int ret = 0;
+    struct antispam_user *asu = USER_CONTEXT(storage->user);
+    struct signature_log_config *cfg = asu->backend_config;
 
     if (sltc == NULL)
-	return ret;
+	return 0;
 
-    if (sltc->dict != NULL)
+    if (cfg->flush_interval > 0 && current_ioloop != NULL)
     {
-	// ret = dict_transaction_commit(&sltc->dict_ctx); // see comment above
-	dict_deinit(&sltc->dict);
+	signature_log_merge(&sltc);
+	return 0;
     }
 
-    i_free(sltc);
+    if (signature_log_write(&sltc) < 0)
+    {
+	mail_storage_set_error(storage, MAIL_ERROR_NOTPOSSIBLE,
+		"Failed to increment signature values");
+	return -1;
+    }
 
-    return ret;
+    return 0;
 }
 
-void signature_log_transaction_rollback(struct mailbox *box ATTR_UNUSED,
+void signature_log_transaction_rollback(struct mail_storage *storage ATTR_UNUSED,
 	void *data)
 {
     struct signature_log_transaction_context *sltc = data;
@@ -166,66 +1226,99 @@ void signature_log_transaction_rollback(struct mailbox *box ATTR_UNUSED,
     if (sltc == NULL)
 	return;
 
-    if (sltc->dict != NULL)
-    {
-	//dict_transaction_rollback(&sltc->dict_ctx); // see comment above
-	dict_deinit(&sltc->dict);
-    }
+    signature_log_free(&sltc);
+}
 
-    i_free(sltc);
+bool signature_log_transaction_merge(struct mail_storage *storage
+	ATTR_UNUSED, void *dst, void *src)
+{
+    struct signature_log_transaction_context *dst_sltc = dst;
+    struct signature_log_transaction_context *src_sltc = src;
+    const struct signature_log_delta *delta;
+
+    if (dst_sltc == NULL || src_sltc == NULL)
+	return FALSE;
+
+    array_foreach(&src_sltc->deltas, delta)
+	signature_log_add_key(dst_sltc, delta->key, delta->signature,
+		delta->delta);
+
+    signature_log_free(&src_sltc);
+    return TRUE;
 }
 
 int signature_log_handle_mail(struct mailbox_transaction_context *t,
 	void *data, struct mail *mail, bool spam)
 {
     struct signature_log_transaction_context *sltc = data;
+    struct antispam_user *asu = USER_CONTEXT(t->box->storage->user);
+    struct signature_log_config *cfg = asu->backend_config;
     const char *signature;
 
-    int ret = 0;
-
-    if (sltc->dict == NULL)
+    if (sltc == NULL)
     {
 	mail_storage_set_error(t->box->storage, MAIL_ERROR_NOTPOSSIBLE,
-		"Failed to initialise dict connection");
+		"Internal error during transaction initialization");
 	return -1;
     }
 
-    ret = signature_extract(t, mail, &signature);
-    if (ret != 0)
+    if (signature_extract(cfg->sig_data, mail, &signature) != 0)
     {
 	mail_storage_set_error(t->box->storage, MAIL_ERROR_NOTPOSSIBLE,
 		"Error retrieving signature header from the mail");
 	return -1;
     }
 
-    if (signature == NULL)
-	return 0;
+    if (signature != NULL)
+	signature_log_add(sltc, signature, spam);
 
-    T_BEGIN
-    {
-	const char *tmp = t_strconcat(DICT_PATH_PRIVATE, signature, NULL);
-	const char *ex;
+    return 0;
+}
 
-	ret = dict_lookup(sltc->dict, unsafe_data_stack_pool, tmp, &ex);
+int signature_log_handle_mails(struct mailbox_transaction_context *t,
+	void *data, struct mail *mail, const struct antispam_mail_ref *refs,
+	unsigned int count)
+{
+    unsigned int i;
 
-	sltc->dict_ctx = dict_transaction_begin(sltc->dict);
-	if (ret == 0)
-	    dict_set(sltc->dict_ctx, tmp, "0");
-	dict_atomic_inc(sltc->dict_ctx, tmp, spam ? 1 : -1);
+    for (i = 0; i < count; i++)
+    {
+	if (!mail_set_uid(mail, refs[i].uid))
+	    continue;	// expunged meanwhile, nothing to train
+
+	if (signature_log_handle_mail(t, data, mail, refs[i].spam) < 0)
+	    return -1;
     }
-    T_END;
 
-    ret = dict_transaction_commit(&sltc->dict_ctx);
+    return 0;
+}
 
-    if (ret == 1)
-	return 0;
+void signature_log_deinit(struct mail_user *user, void *data)
+{
+    struct signature_log_config *cfg = data;
 
-    if (ret == 0)
-	mail_storage_set_error(t->box->storage, MAIL_ERROR_NOTPOSSIBLE,
-		"Failed to add signature key");
-    else
-	mail_storage_set_error(t->box->storage, MAIL_ERROR_NOTPOSSIBLE,
-		"Failed to increment signature value");
+    if (cfg == NULL)
+	return;
+
+    /*
+     * Without the user context the plugin rejected the user right after
+     * signature_log_init(), nothing was written or scheduled yet.
+     */
+    if (USER_CONTEXT(user) != NULL)
+    {
+	signature_log_flush(user);
+	if (cfg->sweep_to != NULL)
+	    timeout_remove(&cfg->sweep_to);
+	i_free(cfg->sweep_cursor);
+	if (cfg->migrate_to != NULL)
+	    timeout_remove(&cfg->migrate_to);
+	i_free(cfg->migrate_cursor);
+	// waits for the async commits still running
+	signature_log_drop_dict(user);
+    }
 
-    return -1;
+#ifdef HAVE_LMDB
+    if (cfg->lmdb != NULL)
+	lmdb_store_close(&cfg->lmdb);
+#endif
 }
@@ -5,13 +5,23 @@
 #include "mail-user.h"
 #include "mail-storage-private.h"
 
+#include "backends.h"
+
 bool signature_log_init(struct mail_user *user, void **data);
+void signature_log_deinit(struct mail_user *user, void *data);
+const char *const *signature_log_wanted_headers(void *data);
 
-void *signature_log_transaction_begin(struct mailbox *box,
+void *signature_log_transaction_begin(struct mail_storage *storage,
 	enum mailbox_transaction_flags flags);
-int signature_log_transaction_commit(struct mailbox *box, void *data);
-void signature_log_transaction_rollback(struct mailbox *box, void *data);
+int signature_log_transaction_commit(struct mail_storage *storage, void *data);
+void signature_log_transaction_rollback(struct mail_storage *storage,
+	void *data);
+bool signature_log_transaction_merge(struct mail_storage *storage,
+	void *dst, void *src);
 int signature_log_handle_mail(struct mailbox_transaction_context *t,
 	void *data, struct mail *mail, bool spam);
+int signature_log_handle_mails(struct mailbox_transaction_context *t,
+	void *data, struct mail *mail, const struct antispam_mail_ref *refs,
+	unsigned int count);
 
 #endif
@@ -1,16 +1,20 @@
 #include <stdlib.h>
 
 #include "lib.h"
+#include "str.h"
 #include "mail-storage.h"
 #include "mail-user.h"
 
 #include "aux.h"
 #include "signature.h"
+#include "user.h"
 
 struct signature_data
 {
     const char *header;
     bool ignore_missing;
+
+    const char *wanted[2];	// header, NULL
 };
 
 bool signature_init(struct mail_user *user, void **data)
@@ -28,6 +32,7 @@ bool signature_init(struct mail_user *user, void **data)
 	goto bailout;
     }
     cfg->header = tmp;
+    cfg->wanted[0] = tmp;
 
     tmp = config(user, "signature_missing");
     if (EMPTY_STR(tmp))
@@ -53,6 +58,37 @@ fail:
     return FALSE;
 }
 
+/*
+ * The raw values are as they are in the mail, a signature folded over
+ * several lines has to be put together again. Returns the value itself if
+ * it isn't folded.
+ */
+static const char *signature_unfold(const char *value)
+{
+    string_t *str;
+    const char *p;
+
+    if (strpbrk(value, "\r\n") == NULL)
+	return value;
+
+    str = t_str_new(strlen(value));
+    for (p = value; *p != '\0'; p++)
+    {
+	if (*p == '\r')
+	    continue;
+	if (*p == '\n')
+	{
+	    // and the whitespace the continuation line starts with
+	    while (p[1] == ' ' || p[1] == '\t')
+		p++;
+	    continue;
+	}
+	str_append_c(str, *p);
+    }
+
+    return str_c(str);
+}
+
 int signature_extract(void *data, struct mail *mail, const char **signature)
 {
     struct signature_data *cfg = data;
@@ -61,15 +97,20 @@ int signature_extract(void *data, struct mail *mail, const char **signature)
 
     *signature = NULL;
 
-    ret = mail_get_headers_utf8(mail, cfg->header, &signatures);
+    /*
+     * Signatures are plain ASCII, so the raw values do and nothing needs
+     * to be decoded. With the header wanted (signature_wanted_headers())
+     * they come from the cache file instead of parsing the mail.
+     */
+    ret = mail_get_headers(mail, cfg->header, &signatures);
 
-    if (ret < 0)
+    if (ret < 0 || signatures == NULL || signatures[0] == NULL)
 	return cfg->ignore_missing == TRUE ? 0 : -1;
 
     while (signatures[1])
 	signatures++;
 
-    *signature = signatures[0];
+    *signature = signature_unfold(signatures[0]);
 
     return 0;
 }
@@ -81,51 +122,74 @@ const char *signature_header(void *data)
     return cfg->header;
 }
 
-void signature_list_append(struct siglist **list, const char *sig, bool spam)
+const char *const *signature_wanted_headers(void *data)
 {
-    struct siglist *ptr;
+    struct signature_data *cfg = data;
 
-    if (list == NULL || sig == NULL)
-	return;
+    return cfg->wanted;
+}
 
-    if (*list == NULL)
-    {
-	*list = i_new(struct siglist, 1);
-	i_assert(*list != NULL);
-    }
-    ptr = *list;
+static const char *signature_trained_key(struct antispam_user *asu,
+	const char *sig)
+{
+    return t_strconcat(asu->backend->title, ":", sig, NULL);
+}
+
+static bool signature_trained(struct mail_user *user, const char *sig,
+	bool spam)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    unsigned int value;
+    bool ret;
 
-    while (ptr->next != NULL)
-	ptr = ptr->next;
+    if (asu->trained_cache == NULL || sig == NULL)
+	return FALSE;
 
-    if (ptr->sig != NULL)
+    T_BEGIN
     {
-	ptr = ptr->next = i_new(struct siglist, 1);
-	i_assert(ptr != NULL);
+	ret = mmap_table_lookup(asu->trained_cache,
+		signature_trained_key(asu, sig), asu->trained_cache_ttl,
+		&value) && value == (spam ? 1 : 0);
     }
+    T_END;
+
+    if (ret)
+	asu->stats.trained_cache_hits++;
+    else
+	asu->stats.trained_cache_misses++;
 
-    ptr->sig = i_strdup(sig);
-    ptr->spam = spam;
-    i_assert(ptr->sig != NULL);
+    return ret;
 }
 
-void signature_list_free(struct siglist **list)
+void signature_list_drop_trained(struct mail_user *user,
+	struct siglist *list)
 {
-    struct siglist *item;
-    struct siglist *next;
-
-    if (list == NULL || *list == NULL)
-	return;
-
-    item = *list;
+    struct siglist_item *item, *next;
 
-    while (item)
+    for (item = list->head; item != NULL; item = next)
     {
 	next = item->next;
+	if (signature_trained(user, item->sig, item->spam))
+	    signature_list_unlink(list, item);
+    }
+}
+
+void signature_list_trained(struct mail_user *user,
+	const struct siglist *list)
+{
+    struct antispam_user *asu = USER_CONTEXT(user);
+    const struct siglist_item *item;
 
-	i_free(item->sig);
-	i_free(item);
+    if (asu->trained_cache == NULL)
+	return;
 
-	item = next;
+    for (item = list->head; item != NULL; item = item->next)
+    {
+	T_BEGIN
+	{
+	    mmap_table_insert(asu->trained_cache,
+		    signature_trained_key(asu, item->sig), item->spam ? 1 : 0);
+	}
+	T_END;
     }
 }
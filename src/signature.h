@@ -4,19 +4,25 @@
 #include "lib.h"
 #include "mail-user.h"
 
-struct siglist
-{
-    char *sig;
-    bool spam;
-    struct siglist *next;
-};
+#include "siglist.h"
 
 bool signature_init(struct mail_user *user, void **data);
 
 int signature_extract(void *data, struct mail *mail, const char **signature);
 const char *signature_header(void *data);
+/* The headers signature_extract() reads, NULL-terminated. */
+const char *const *signature_wanted_headers(void *data);
 
-void signature_list_append(struct siglist **list, const char *sig, bool spam);
-void signature_list_free(struct siglist **list);
+/*
+ * The host-wide cache of antispam_trained_cache. Right before a list is
+ * trained, the items that this backend trained as their final class
+ * lately, for any user, are unlinked; only the netted result is looked up
+ * so that a cached event can't leave its opposite one unbalanced. The
+ * signatures of a list are added once the backend trained them.
+ */
+void signature_list_drop_trained(struct mail_user *user,
+	struct siglist *list);
+void signature_list_trained(struct mail_user *user,
+	const struct siglist *list);
 
 #endif
@@ -0,0 +1,386 @@
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "write-full.h"
+#include "hostpid.h"
+
+#include "smtp.h"
+
+#define SMTP_TIMEOUT_SECS 60
+#define SMTP_MAX_LINE_LENGTH 4096
+#define SMTP_OUTPUT_FLUSH_SIZE (64 * 1024)
+
+struct smtp_connection
+{
+    char *address;
+    int fd;
+    struct istream *input;
+    string_t *output;
+
+    bool lmtp;
+    bool pipelining;
+    bool failed;
+
+    // body encoding state
+    bool line_start;
+    bool cr;
+
+    // final reply of the previous message, not read yet
+    int *pending_result;
+};
+
+static int smtp_socket(const char *address)
+{
+    struct timeval tv;
+    int fd = -1;
+
+    if (address[0] == '/')
+    {
+	struct sockaddr_un sa;
+
+	if (strlen(address) >= sizeof(sa.sun_path))
+	{
+	    i_error("antispam: socket path too long: %s", address);
+	    return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, address);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+	    return -1;
+
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+	{
+	    close(fd);
+	    return -1;
+	}
+    }
+    else
+    {
+	struct addrinfo hints, *res, *ai;
+	const char *host, *port;
+
+	port = strrchr(address, ':');
+	if (port == NULL)
+	{
+	    i_error("antispam: invalid socket address: %s", address);
+	    return -1;
+	}
+	host = t_strdup_until(address, port++);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+	{
+	    i_error("antispam: couldn't resolve %s", address);
+	    return -1;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+	{
+	    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	    if (fd == -1)
+		continue;
+	    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		break;
+	    close(fd);
+	    fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1)
+	    return -1;
+    }
+
+    // we block on the socket, but never forever
+    tv.tv_sec = SMTP_TIMEOUT_SECS;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+static int smtp_flush(struct smtp_connection *conn)
+{
+    if (conn->failed)
+	return -2;
+
+    if (str_len(conn->output) > 0
+	    && write_full(conn->fd, str_data(conn->output),
+		    str_len(conn->output)) < 0)
+    {
+	i_error("antispam: write(%s) failed: %m", conn->address);
+	conn->failed = TRUE;
+    }
+
+    str_truncate(conn->output, 0);
+    return conn->failed ? -2 : 0;
+}
+
+/*
+ * Reads a (possibly multiline) reply and returns its code. The reply
+ * text of the EHLO/LHLO greeting is checked for PIPELINING.
+ */
+static int smtp_read_reply(struct smtp_connection *conn, bool greeting)
+{
+    const char *line;
+
+    if (conn->failed)
+	return -2;
+
+    for (;;)
+    {
+	line = i_stream_read_next_line(conn->input);
+	if (line == NULL)
+	{
+	    i_error("antispam: connection to %s lost", conn->address);
+	    conn->failed = TRUE;
+	    return -2;
+	}
+
+	if (strlen(line) < 3 || !i_isdigit(line[0]) || !i_isdigit(line[1])
+		|| !i_isdigit(line[2]))
+	{
+	    i_error("antispam: invalid reply from %s: %s", conn->address,
+		    line);
+	    conn->failed = TRUE;
+	    return -2;
+	}
+
+	if (greeting && strlen(line) > 4
+		&& strcasecmp(line + 4, "PIPELINING") == 0)
+	    conn->pipelining = TRUE;
+
+	if (line[3] != '-')
+	    break;
+    }
+
+    if (line[0] != '2' && line[0] != '3')
+	i_debug("antispam: %s replied: %s", conn->address, line);
+
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+static int smtp_read_pending(struct smtp_connection *conn)
+{
+    int ret;
+
+    if (conn->pending_result == NULL)
+	return 0;
+
+    ret = smtp_read_reply(conn, FALSE);
+    *conn->pending_result = ret;
+    conn->pending_result = NULL;
+
+    return ret == -2 ? -2 : 0;
+}
+
+struct smtp_connection *smtp_connect(const char *address, bool lmtp)
+{
+    struct smtp_connection *conn;
+    int fd;
+
+    fd = smtp_socket(address);
+    if (fd == -1)
+    {
+	i_error("antispam: couldn't connect to %s: %m", address);
+	return NULL;
+    }
+
+    conn = i_new(struct smtp_connection, 1);
+    conn->address = i_strdup(address);
+    conn->fd = fd;
+    conn->lmtp = lmtp;
+    conn->input = i_stream_create_fd(fd, SMTP_MAX_LINE_LENGTH, FALSE);
+    conn->output = str_new(default_pool, 1024);
+
+    if (smtp_read_reply(conn, FALSE) == 220)
+    {
+	str_printfa(conn->output, "%s %s\r\n", lmtp ? "LHLO" : "EHLO",
+		my_hostname);
+	if (smtp_flush(conn) == 0 && smtp_read_reply(conn, TRUE) == 250)
+	    return conn;
+    }
+
+    i_error("antispam: %s refused the session", address);
+    conn->failed = TRUE;
+    smtp_disconnect(&conn);
+    return NULL;
+}
+
+int smtp_message_begin(struct smtp_connection *conn, const char *from,
+	const char *from_params, const char *rcpt)
+{
+    int mail_ret, rcpt_ret, data_ret;
+
+    str_printfa(conn->output, "MAIL FROM:<%s>%s%s\r\n", from,
+	    from_params == NULL ? "" : " ",
+	    from_params == NULL ? "" : from_params);
+
+    if (conn->pipelining)
+    {
+	str_printfa(conn->output, "RCPT TO:<%s>\r\nDATA\r\n", rcpt);
+	if (smtp_flush(conn) < 0 || smtp_read_pending(conn) < 0)
+	    return -2;
+
+	mail_ret = smtp_read_reply(conn, FALSE);
+	rcpt_ret = smtp_read_reply(conn, FALSE);
+	data_ret = smtp_read_reply(conn, FALSE);
+    }
+    else
+    {
+	rcpt_ret = data_ret = -1;
+
+	if (smtp_flush(conn) < 0)
+	    return -2;
+	mail_ret = smtp_read_reply(conn, FALSE);
+
+	if (mail_ret / 100 == 2)
+	{
+	    str_printfa(conn->output, "RCPT TO:<%s>\r\n", rcpt);
+	    if (smtp_flush(conn) < 0)
+		return -2;
+	    rcpt_ret = smtp_read_reply(conn, FALSE);
+	}
+
+	if (rcpt_ret / 100 == 2)
+	{
+	    str_append(conn->output, "DATA\r\n");
+	    if (smtp_flush(conn) < 0)
+		return -2;
+	    data_ret = smtp_read_reply(conn, FALSE);
+	}
+    }
+
+    if (conn->failed)
+	return -2;
+
+    if (data_ret == 354)
+    {
+	if (mail_ret / 100 == 2 && rcpt_ret / 100 == 2)
+	{
+	    conn->line_start = TRUE;
+	    conn->cr = FALSE;
+	    return 0;
+	}
+
+	// should never happen, but don't leave the server hanging
+	str_append(conn->output, ".\r\n");
+	if (smtp_flush(conn) < 0 || smtp_read_reply(conn, FALSE) == -2)
+	    return -2;
+    }
+
+    str_append(conn->output, "RSET\r\n");
+    if (smtp_flush(conn) < 0 || smtp_read_reply(conn, FALSE) == -2)
+	return -2;
+
+    return -1;
+}
+
+void smtp_message_data(struct smtp_connection *conn, const void *data,
+	size_t size)
+{
+    const unsigned char *p = data;
+    size_t i, start = 0;
+
+    for (i = 0; i < size; i++)
+    {
+	if (conn->line_start && p[i] == '.')
+	{
+	    str_append_n(conn->output, p + start, i - start);
+	    str_append_c(conn->output, '.');
+	    start = i;
+	}
+	else if (p[i] == '\n' && !conn->cr)
+	{
+	    str_append_n(conn->output, p + start, i - start);
+	    str_append_c(conn->output, '\r');
+	    start = i;
+	}
+
+	conn->cr = p[i] == '\r';
+	conn->line_start = p[i] == '\n';
+    }
+    str_append_n(conn->output, p + start, size - start);
+
+    if (str_len(conn->output) >= SMTP_OUTPUT_FLUSH_SIZE)
+	(void) smtp_flush(conn);
+}
+
+int smtp_message_end(struct smtp_connection *conn, int *result_r)
+{
+    if (!conn->line_start)
+	str_append(conn->output, "\r\n");
+    str_append(conn->output, ".\r\n");
+
+    *result_r = -2;
+
+    if (conn->pipelining)
+    {
+	// sent together with the next command
+	conn->pending_result = result_r;
+	return conn->failed ? -2 : 0;
+    }
+
+    if (smtp_flush(conn) < 0)
+	return -2;
+
+    *result_r = smtp_read_reply(conn, FALSE);
+    return *result_r == -2 ? -2 : 0;
+}
+
+static void smtp_free(struct smtp_connection *conn)
+{
+    i_stream_destroy(&conn->input);
+    str_free(&conn->output);
+    close(conn->fd);
+    i_free(conn->address);
+    i_free(conn);
+}
+
+int smtp_disconnect(struct smtp_connection **_conn)
+{
+    struct smtp_connection *conn = *_conn;
+    int ret;
+
+    *_conn = NULL;
+
+    str_append(conn->output, "QUIT\r\n");
+    (void) smtp_flush(conn);
+
+    // stores -2 into the pending result if the connection failed
+    ret = smtp_read_pending(conn);
+
+    // QUIT may legitimately be answered by closing the connection
+    if (!conn->failed)
+	(void) smtp_read_reply(conn, FALSE);
+
+    smtp_free(conn);
+    return ret;
+}
+
+void smtp_abort(struct smtp_connection **_conn)
+{
+    struct smtp_connection *conn = *_conn;
+
+    *_conn = NULL;
+
+    // the reply of the previous message is never read
+    if (conn->pending_result != NULL)
+	*conn->pending_result = -2;
+
+    smtp_free(conn);
+}
@@ -0,0 +1,56 @@
+#ifndef ANTISPAM_SMTP_H
+#define ANTISPAM_SMTP_H
+
+#include "lib.h"
+
+/*
+ * Minimal blocking SMTP/LMTP client used by the backends that talk to a
+ * daemon instead of executing a binary per mail. One connection carries
+ * any number of messages; when the server announces PIPELINING the
+ * envelope commands and the final reply of the previous message are
+ * pipelined, so each message costs a single round trip.
+ */
+
+struct smtp_connection;
+
+/*
+ * address is either an absolute path of a UNIX socket or "host:port".
+ * Returns NULL on failure, the reason is logged.
+ */
+struct smtp_connection *smtp_connect(const char *address, bool lmtp);
+
+/*
+ * Starts a new message: MAIL FROM, RCPT TO and DATA. from_params may be
+ * NULL. Returns 0 when the server is ready to accept the message body,
+ * -1 when the server refused the message (the connection stays usable)
+ * and -2 on connection failure.
+ */
+int smtp_message_begin(struct smtp_connection *conn, const char *from,
+	const char *from_params, const char *rcpt);
+
+/* Appends raw message data, dot-stuffing and CRLF-converting it. */
+void smtp_message_data(struct smtp_connection *conn, const void *data,
+	size_t size);
+
+/*
+ * Terminates the message body. The server reply code will be stored into
+ * *result_r, which must stay valid until the next smtp_message_begin() or
+ * smtp_disconnect() call. Returns -2 on connection failure, 0 otherwise.
+ */
+int smtp_message_end(struct smtp_connection *conn, int *result_r);
+
+/*
+ * Collects all outstanding replies and closes the connection.
+ * Returns -2 on connection failure, 0 otherwise.
+ */
+int smtp_disconnect(struct smtp_connection **conn);
+
+/*
+ * Closes the connection without sending or reading anything, for when a
+ * message body can't be completed: the server then drops the unterminated
+ * message rather than taking what follows as part of it. A pending result
+ * is set to -2.
+ */
+void smtp_abort(struct smtp_connection **conn);
+
+#endif
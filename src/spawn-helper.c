@@ -0,0 +1,426 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "lib.h"
+#include "array.h"
+#include "fd-close-on-exec.h"
+
+#include "spawn-helper.h"
+
+#define SPAWN_HELPER_MAX_REQUEST (64 * 1024)
+
+struct spawn_helper_reply
+{
+    uint32_t id;
+    int32_t status;
+};
+
+struct spawn_helper_child
+{
+    pid_t pid;
+    uint32_t id;
+};
+ARRAY_DEFINE_TYPE(spawn_helper_child, struct spawn_helper_child);
+
+static int helper_fd = -1;
+static pid_t helper_pid = -1;
+// the user the helper was forked for, with their uid and environment
+static char *helper_owner = NULL;
+static uid_t helper_uid;
+static unsigned int helper_next_id = 1;
+
+/*
+ * The helper process
+ */
+
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void helper_sigchld(int signo ATTR_UNUSED)
+{
+    int saved_errno = errno;
+
+    (void) write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+static void helper_close_fds(int sock)
+{
+    int fd, max_fd;
+
+#ifdef SYS_close_range
+    if ((sock == 3 || syscall(SYS_close_range, 3, sock - 1, 0) == 0)
+	    && syscall(SYS_close_range, sock + 1, ~0U, 0) == 0)
+	return;
+#endif
+
+    max_fd = getdtablesize();
+    for (fd = 3; fd < max_fd; fd++)
+	if (fd != sock)
+	    close(fd);
+}
+
+static void helper_send_status(int sock, uint32_t id, int status)
+{
+    struct spawn_helper_reply reply;
+
+    reply.id = id;
+    reply.status = status;
+    (void) send(sock, &reply, sizeof(reply), 0);
+}
+
+static void helper_spawn(int sock, ARRAY_TYPE(spawn_helper_child) *children,
+	char *buf, size_t size, const int fds[3])
+{
+    struct spawn_helper_child *child;
+    const char *binary, **argv;
+    unsigned int i, argc = 0;
+    uint32_t id;
+    size_t pos;
+    pid_t pid;
+
+    memcpy(&id, buf, sizeof(id));
+    buf[size - 1] = '\0';
+
+    // binary, argv[0], ..., argv[argc - 1], all NUL-terminated
+    for (pos = sizeof(id); pos < size; pos++)
+	if (buf[pos] == '\0')
+	    argc++;
+
+    if (argc < 2)
+    {
+	helper_send_status(sock, id, -1);
+	return;
+    }
+
+    argv = calloc(argc, sizeof(const char *));
+    binary = buf + sizeof(id);
+    pos = sizeof(id) + strlen(binary) + 1;
+    for (i = 0; i < argc - 1; i++)
+    {
+	argv[i] = buf + pos;
+	pos += strlen(argv[i]) + 1;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+	sigset_t mask;
+
+	if (dup2(fds[0], 0) != 0 || dup2(fds[1], 1) != 1
+		|| dup2(fds[2], 2) != 2)
+	    _exit(1);
+
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	signal(SIGCHLD, SIG_DFL);
+
+	execv(binary, (char *const *) argv);
+	_exit(127);
+    }
+    free(argv);
+
+    if (pid < 0)
+    {
+	helper_send_status(sock, id, -1);
+	return;
+    }
+
+    child = array_append_space(children);
+    child->pid = pid;
+    child->id = id;
+}
+
+static void helper_reap(int sock, ARRAY_TYPE(spawn_helper_child) *children)
+{
+    const struct spawn_helper_child *list;
+    unsigned int i, count;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+	list = array_get(children, &count);
+	for (i = 0; i < count; i++)
+	{
+	    if (list[i].pid != pid)
+		continue;
+
+	    helper_send_status(sock, list[i].id,
+		    WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	    array_delete(children, i, 1);
+	    break;
+	}
+    }
+}
+
+static void ATTR_NORETURN helper_main(int sock)
+{
+    ARRAY_TYPE(spawn_helper_child) children;
+    struct sigaction act;
+    struct pollfd pfd[2];
+    char *buf;
+    int fd;
+
+    // don't keep the client connection or anything else alive
+    helper_close_fds(sock);
+    fd = open("/dev/null", O_RDWR);
+    if (fd != -1)
+    {
+	dup2(fd, 0);
+	dup2(fd, 1);
+	if (fd > 2)
+	    close(fd);
+    }
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe(sigchld_pipe) < 0)
+	_exit(1);
+    fd_close_on_exec(sigchld_pipe[0], TRUE);
+    fd_close_on_exec(sigchld_pipe[1], TRUE);
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+    fd_close_on_exec(sock, TRUE);
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = helper_sigchld;
+    act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGCHLD, &act, NULL);
+
+    i_array_init(&children, 8);
+    buf = i_malloc(SPAWN_HELPER_MAX_REQUEST);
+
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sigchld_pipe[0];
+    pfd[1].events = POLLIN;
+
+    for (;;)
+    {
+	if (poll(pfd, 2, -1) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+
+	if ((pfd[1].revents & POLLIN) != 0)
+	{
+	    char tmp[64];
+
+	    while (read(sigchld_pipe[0], tmp, sizeof(tmp)) > 0) ;
+	    helper_reap(sock, &children);
+	}
+
+	if (pfd[0].revents != 0)
+	{
+	    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	    struct msghdr msg;
+	    struct cmsghdr *cmsg;
+	    struct iovec iov;
+	    int fds[3];
+	    ssize_t ret;
+
+	    memset(&msg, 0, sizeof(msg));
+	    iov.iov_base = buf;
+	    iov.iov_len = SPAWN_HELPER_MAX_REQUEST;
+	    msg.msg_iov = &iov;
+	    msg.msg_iovlen = 1;
+	    msg.msg_control = cbuf;
+	    msg.msg_controllen = sizeof(cbuf);
+
+	    ret = recvmsg(sock, &msg, 0);
+	    if (ret < 0 && errno == EINTR)
+		continue;
+	    if (ret <= 0)
+		break;
+
+	    cmsg = CMSG_FIRSTHDR(&msg);
+	    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+		    || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))
+		    || ret <= (ssize_t) sizeof(uint32_t))
+		break;
+	    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	    // or the children spawned meanwhile inherit them
+	    fd_close_on_exec(fds[0], TRUE);
+	    fd_close_on_exec(fds[1], TRUE);
+	    fd_close_on_exec(fds[2], TRUE);
+
+	    helper_spawn(sock, &children, buf, ret, fds);
+
+	    close(fds[0]);
+	    close(fds[1]);
+	    close(fds[2]);
+	}
+    }
+
+    // the plugin is gone, the remaining children run on without us
+    _exit(0);
+}
+
+/*
+ * The plugin side
+ */
+
+bool spawn_helper_start(const char *owner)
+{
+    int fds[2];
+
+    if (spawn_helper_running(owner))
+	return TRUE;
+
+    // forked for another user of this process, which is done with it
+    spawn_helper_stop();
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+    {
+	i_error("antispam: socketpair() failed: %m");
+	return FALSE;
+    }
+
+    helper_pid = fork();
+    if (helper_pid < 0)
+    {
+	i_error("antispam: fork() failed: %m");
+	close(fds[0]);
+	close(fds[1]);
+	return FALSE;
+    }
+
+    if (helper_pid == 0)
+    {
+	close(fds[0]);
+	helper_main(fds[1]);
+    }
+
+    close(fds[1]);
+    helper_fd = fds[0];
+    fd_close_on_exec(helper_fd, TRUE);
+    helper_owner = i_strdup(owner);
+    helper_uid = geteuid();
+
+    return TRUE;
+}
+
+void spawn_helper_stop(void)
+{
+    if (helper_fd == -1)
+	return;
+
+    close(helper_fd);
+    helper_fd = -1;
+
+    // it exits as soon as it sees the socket closed
+    (void) waitpid(helper_pid, NULL, 0);
+    helper_pid = -1;
+    i_free(helper_owner);
+}
+
+bool spawn_helper_running(const char *owner)
+{
+    return helper_fd != -1 && strcmp(helper_owner, owner) == 0
+	    && helper_uid == geteuid();
+}
+
+unsigned int spawn_helper_spawn(const char *binary, const char *const *argv,
+	const int fds[3])
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t id;
+    char *buf;
+    size_t size, pos;
+    unsigned int i;
+    ssize_t ret;
+
+    if (helper_fd == -1)
+	return 0;
+
+    size = sizeof(id) + strlen(binary) + 1;
+    for (i = 0; argv[i] != NULL; i++)
+	size += strlen(argv[i]) + 1;
+
+    if (size > SPAWN_HELPER_MAX_REQUEST)
+	return 0;
+
+    id = helper_next_id++;
+    if (helper_next_id == 0)
+	helper_next_id = 1;
+
+    buf = i_malloc(size);
+    memcpy(buf, &id, sizeof(id));
+    pos = sizeof(id);
+    memcpy(buf + pos, binary, strlen(binary) + 1);
+    pos += strlen(binary) + 1;
+    for (i = 0; argv[i] != NULL; i++)
+    {
+	memcpy(buf + pos, argv[i], strlen(argv[i]) + 1);
+	pos += strlen(argv[i]) + 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+    ret = sendmsg(helper_fd, &msg, 0);
+    i_free(buf);
+
+    if (ret < 0)
+    {
+	i_error("antispam: spawn helper is gone: %m");
+	spawn_helper_stop();
+	return 0;
+    }
+
+    return id;
+}
+
+int spawn_helper_fd(void)
+{
+    return helper_fd;
+}
+
+int spawn_helper_read_status(unsigned int *id_r, int *status_r)
+{
+    struct spawn_helper_reply reply;
+    ssize_t ret;
+
+    if (helper_fd == -1)
+	return -1;
+
+    ret = recv(helper_fd, &reply, sizeof(reply), MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
+    if (ret != sizeof(reply))
+    {
+	i_error("antispam: spawn helper is gone");
+	spawn_helper_stop();
+	return -1;
+    }
+
+    *id_r = reply.id;
+    *status_r = reply.status;
+    return 1;
+}
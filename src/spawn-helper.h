@@ -0,0 +1,43 @@
+#ifndef ANTISPAM_SPAWN_HELPER_H
+#define ANTISPAM_SPAWN_HELPER_H
+
+#include "lib.h"
+
+/*
+ * The spawn helper is a small process forked while the imap process is
+ * still small. The training programs are then forked from it instead of
+ * from the (possibly huge) imap process, which makes fork() cheap.
+ */
+
+/*
+ * The helper runs the programs with the uid and environment of the user it
+ * was started for, the owner, and only does so for them. Starting it for
+ * another user of the same process (lmtp, doveadm -A) replaces it.
+ */
+
+/* Starts the helper for owner unless it is running for them already. */
+bool spawn_helper_start(const char *owner);
+void spawn_helper_stop(void);
+
+/* Returns TRUE if the helper is running for owner. */
+bool spawn_helper_running(const char *owner);
+
+/*
+ * Asks the helper to run binary with fds[0..2] as its stdin, stdout and
+ * stderr. Returns the id the exit status will be reported with, or 0 on
+ * failure.
+ */
+unsigned int spawn_helper_spawn(const char *binary, const char *const *argv,
+	const int fds[3]);
+
+/* The descriptor to poll for spawn_helper_read_status(). */
+int spawn_helper_fd(void);
+
+/*
+ * Reads one exit status without blocking. Returns 1 if one was read, 0 if
+ * none is available and -1 if the helper is gone. status is the exit code
+ * of the child or -1 if it couldn't be started or didn't exit normally.
+ */
+int spawn_helper_read_status(unsigned int *id_r, int *status_r);
+
+#endif
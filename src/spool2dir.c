@@ -151,7 +151,7 @@ fail:
 }
 
 
-void *spool2dir_transaction_begin(struct mailbox *box ATTR_UNUSED,
+void *spool2dir_transaction_begin(struct mail_storage *storage ATTR_UNUSED,
 	enum mailbox_transaction_flags flags ATTR_UNUSED)
 {
     struct spool2dir_transaction_context *s2dtc;
@@ -165,7 +165,8 @@ void *spool2dir_transaction_begin(struct mailbox *box ATTR_UNUSED,
     return s2dtc;
 }
 
-int spool2dir_transaction_commit(struct mailbox *box ATTR_UNUSED, void *data)
+int spool2dir_transaction_commit(struct mail_storage *storage ATTR_UNUSED,
+	void *data)
 {
     struct spool2dir_transaction_context *s2dtc = data;
 
@@ -174,7 +175,7 @@ int spool2dir_transaction_commit(struct mailbox *box ATTR_UNUSED, void *data)
     return 0;
 }
 
-void spool2dir_transaction_rollback(struct mailbox *box ATTR_UNUSED,
+void spool2dir_transaction_rollback(struct mail_storage *storage ATTR_UNUSED,
 	void *data)
 {
     struct spool2dir_transaction_context *s2dtc = data;
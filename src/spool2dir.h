@@ -7,10 +7,10 @@
 
 bool spool2dir_init(struct mail_user *user, void **data);
 
-void *spool2dir_transaction_begin(struct mailbox *box,
+void *spool2dir_transaction_begin(struct mail_storage *storage,
 	enum mailbox_transaction_flags flags);
-int spool2dir_transaction_commit(struct mailbox *box, void *data);
-void spool2dir_transaction_rollback(struct mailbox *box, void *data);
+int spool2dir_transaction_commit(struct mail_storage *storage, void *data);
+void spool2dir_transaction_rollback(struct mail_storage *storage, void *data);
 int spool2dir_handle_mail(struct mailbox_transaction_context *t, void *data,
 	struct mail *mail, bool spam);
 
@@ -0,0 +1,120 @@
+#include "lib.h"
+
+#include "strmap.h"
+
+struct strmap_entry
+{
+    char *key;
+    void *value;
+    unsigned int hash;
+};
+
+struct strmap
+{
+    pool_t pool;
+    struct strmap_entry *entries;
+    unsigned int size;		// always a power of two
+    unsigned int count;
+};
+
+static unsigned int strmap_hash(const char *key)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *key != '\0'; key++)
+	hash = (hash ^ (unsigned char) *key) * 16777619U;
+
+    return hash;
+}
+
+static struct strmap_entry *strmap_find(const struct strmap *map,
+	const char *key, unsigned int hash)
+{
+    struct strmap_entry *entry;
+    unsigned int i = hash & (map->size - 1);
+
+    for (;;)
+    {
+	entry = &map->entries[i];
+	if (entry->key == NULL
+		|| (entry->hash == hash && strcmp(entry->key, key) == 0))
+	    return entry;
+	i = (i + 1) & (map->size - 1);
+    }
+}
+
+static void strmap_grow(struct strmap *map)
+{
+    struct strmap_entry *old = map->entries;
+    unsigned int i, old_size = map->size;
+
+    map->size *= 2;
+    map->entries = p_new(map->pool, struct strmap_entry, map->size);
+
+    for (i = 0; i < old_size; i++)
+	if (old[i].key != NULL)
+	    *strmap_find(map, old[i].key, old[i].hash) = old[i];
+
+    p_free(map->pool, old);
+}
+
+struct strmap *strmap_create(pool_t pool, unsigned int initial_size)
+{
+    struct strmap *map = p_new(pool, struct strmap, 1);
+
+    map->pool = pool;
+    map->size = 16;
+    while (map->size < initial_size * 2)
+	map->size *= 2;
+    map->entries = p_new(pool, struct strmap_entry, map->size);
+
+    return map;
+}
+
+bool strmap_lookup(const struct strmap *map, const char *key,
+	void **value_r)
+{
+    struct strmap_entry *entry = strmap_find(map, key, strmap_hash(key));
+
+    if (entry->key == NULL)
+	return FALSE;
+
+    *value_r = entry->value;
+    return TRUE;
+}
+
+void strmap_insert(struct strmap *map, const char *key, void *value)
+{
+    unsigned int hash = strmap_hash(key);
+    struct strmap_entry *entry;
+
+    // keep the load factor under 3/4
+    if ((map->count + 1) * 4 > map->size * 3)
+	strmap_grow(map);
+
+    entry = strmap_find(map, key, hash);
+    if (entry->key == NULL)
+    {
+	entry->key = p_strdup(map->pool, key);
+	entry->hash = hash;
+	map->count++;
+    }
+    entry->value = value;
+}
+
+unsigned int strmap_count(const struct strmap *map)
+{
+    return map->count;
+}
+
+void strmap_clear(struct strmap *map)
+{
+    unsigned int i;
+
+    for (i = 0; i < map->size; i++)
+	if (map->entries[i].key != NULL)
+	    p_free(map->pool, map->entries[i].key);
+
+    memset(map->entries, 0, sizeof(*map->entries) * map->size);
+    map->count = 0;
+}
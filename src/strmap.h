@@ -0,0 +1,28 @@
+#ifndef ANTISPAM_STRMAP_H
+#define ANTISPAM_STRMAP_H
+
+#include "lib.h"
+
+/*
+ * A small open addressing hash table mapping strings to pointers. The
+ * keys are copied and everything is allocated from the given pool, so
+ * a map living in a user or transaction pool needs no explicit free.
+ */
+
+struct strmap;
+
+struct strmap *strmap_create(pool_t pool, unsigned int initial_size);
+
+/* Returns TRUE and sets value_r if key is in the map. */
+bool strmap_lookup(const struct strmap *map, const char *key,
+	void **value_r);
+
+/* Adds key or replaces its value. */
+void strmap_insert(struct strmap *map, const char *key, void *value);
+
+unsigned int strmap_count(const struct strmap *map);
+
+/* Removes all the keys. Memory is returned only if the pool frees it. */
+void strmap_clear(struct strmap *map);
+
+#endif
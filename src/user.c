@@ -2,51 +2,91 @@
 
 #include "user.h"
 #include "aux.h"
+#include "strmap.h"
+#include "spawn-helper.h"
+
+// defaults of antispam_trained_cache_size and _ttl
+#define ANTISPAM_TRAINED_CACHE_SLOTS 65536
+#define ANTISPAM_TRAINED_CACHE_TTL 3600
+// default of antispam_trained_ledger_size
+#define ANTISPAM_LEDGER_SLOTS 16384
 
 struct antispam_user_module antispam_user_module =
 MODULE_CONTEXT_INIT(&mail_user_module_register);
 
-static void parse_folders(struct mail_user *user, const char *infix,
-	char ***result)
+/*
+ * Adds the folders of one class to the matcher. Returns TRUE if the class
+ * is configured, i.e. any of its lists starts with a non-empty entry.
+ */
+static bool parse_folders(struct mail_user *user,
+	struct folder_matcher *matcher, const char *infix,
+	enum mailbox_class box_class)
 {
     const char *tmp;
-    enum match_type i;
+    const char *const *iter;
+    unsigned int i;
+    bool ret = FALSE;
 
     T_BEGIN
     {
-	for (i = 0; i < NUM_MT; i++)
+	for (i = 0; i < N_ELEMENTS(match_info); i++)
 	{
 	    tmp = t_strconcat(infix, match_info[i].suffix, NULL);
 	    tmp = config(user, tmp);
-	    if (tmp)
-		result[i] = p_strsplit(user->pool, tmp, ";");
+	    if (!tmp)
+		continue;
+
+	    iter = t_strsplit(tmp, ";");
+	    if (iter[0] != NULL && iter[0][0] != '\0')
+		ret = TRUE;
+
+	    for (; *iter; iter++)
+		folder_matcher_add(matcher, match_info[i].type, *iter,
+			box_class);
 	}
     }
     T_END;
+
+    return ret;
 }
 
-static bool check_folders(char ***folders)
+static void antispam_user_deinit(struct mail_user *user)
 {
-    int i;
-    bool ret = FALSE;
+    struct antispam_user *asu = USER_CONTEXT(user);
+
+    antispam_batch_flush(asu);
+    if (asu->backend->deinit != NULL)
+	asu->backend->deinit(user, asu->backend_config);
 
-    if (folders == NULL)
-	return FALSE;
+    if (user->mail_debug)
+	i_debug("antispam: %u transactions, %u with backend state, "
+		"%u training events coalesced, %u dict connections "
+		"opened, %u reused", asu->stats.transactions,
+		asu->stats.backend_transactions, asu->stats.coalesced_events,
+		asu->stats.dict_connects, asu->stats.dict_reuses);
 
-    for (i = 0; i < NUM_MT; i++)
+    if (asu->trained_cache != NULL)
     {
-	if (folders[i] == NULL || folders[i][0] == NULL)
-	    continue;
-	else if (folders[i][0][0] == '\0')
-	    continue;
-	else
-	{
-	    ret = TRUE;
-	    break;
-	}
+	uint64_t hits, misses;
+
+	mmap_table_get_stats(asu->trained_cache, &hits, &misses);
+	if (user->mail_debug)
+	    i_debug("antispam: trained cache %u hits, %u misses "
+		    "(host-wide %llu, %llu)", asu->stats.trained_cache_hits,
+		    asu->stats.trained_cache_misses,
+		    (unsigned long long) hits, (unsigned long long) misses);
+	mmap_table_close(&asu->trained_cache);
     }
 
-    return ret;
+    if (asu->ledger != NULL)
+    {
+	if (user->mail_debug)
+	    i_debug("antispam: %u copies found trained in the ledger",
+		    asu->stats.ledger_skips);
+	mmap_table_close(&asu->ledger);
+    }
+
+    asu->module_ctx.super.deinit(user);
 }
 
 void antispam_user_created(struct mail_user *user)
@@ -74,6 +114,10 @@ void antispam_user_created(struct mail_user *user)
     if (!asu->backend->init(user, &(asu->backend_config)))
 	goto bailout;
 
+    if (asu->backend->wanted_headers != NULL)
+	asu->wanted_headers =
+		asu->backend->wanted_headers(asu->backend_config);
+
     tmp = config(user, "allow_append_to_spam");
     if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
 	asu->allow_append_to_spam = TRUE;
@@ -82,20 +126,100 @@ void antispam_user_created(struct mail_user *user)
     if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
 	asu->skip_from_line = TRUE;
 
-    parse_folders(user, "spam", asu->folders_spam);
-    parse_folders(user, "trash", asu->folders_trash);
-    parse_folders(user, "unsure", asu->folders_unsure);
+    asu->exec_concurrency = 1;
+    tmp = config(user, "exec_concurrency");
+    if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &asu->exec_concurrency) < 0
+		    || asu->exec_concurrency == 0))
+    {
+	i_error("antispam_exec_concurrency must be a positive number");
+	goto bailout_deinit;
+    }
+
+    tmp = config(user, "train_delay");
+    if (!EMPTY_STR(tmp) && str_to_uint(tmp, &asu->train_delay) < 0)
+    {
+	i_error("antispam_train_delay must be a number of seconds");
+	goto bailout_deinit;
+    }
+
+    tmp = config(user, "batch");
+    if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	asu->batch_commands = TRUE;
+
+    tmp = config(user, "batch_max_mails");
+    if (!EMPTY_STR(tmp) && str_to_uint(tmp, &asu->batch_max_mails) < 0)
+    {
+	i_error("antispam_batch_max_mails must be a number");
+	goto bailout_deinit;
+    }
 
-    if (!(check_folders(asu->folders_spam) || check_folders(asu->folders_trash)
-	    || check_folders(asu->folders_unsure)))
+    asu->folders = folder_matcher_create(user->pool);
+    if (!(parse_folders(user, asu->folders, "spam", CLASS_SPAM)
+	    | parse_folders(user, asu->folders, "trash", CLASS_TRASH)
+	    | parse_folders(user, asu->folders, "unsure", CLASS_UNSURE)))
     {
 	i_error("antispam plugin folders are not configured for this user");
-	goto bailout;
+	goto bailout_deinit;
+    }
+
+    asu->box_classes = strmap_create(user->pool, 64);
+    asu->hooked_classes = antispam_hooked_classes(asu->folders);
+
+    /*
+     * Start the helper now that the configuration is known to be usable,
+     * before this process grows by opening the mailboxes, so that forking
+     * it stays cheap.
+     */
+    tmp = config(user, "spawn_helper");
+    if (!EMPTY_STR(tmp) && strcasecmp(tmp, "yes") == 0)
+	asu->spawn_helper = spawn_helper_start(user->username);
+
+    // these are caches, the user does without if they can't be opened
+    tmp = config(user, "trained_cache");
+    if (!EMPTY_STR(tmp))
+    {
+	const char *path = tmp;
+	unsigned int slots = ANTISPAM_TRAINED_CACHE_SLOTS;
+
+	asu->trained_cache_ttl = ANTISPAM_TRAINED_CACHE_TTL;
+	tmp = config(user, "trained_cache_ttl");
+	if (!EMPTY_STR(tmp) && str_to_uint(tmp, &asu->trained_cache_ttl) < 0)
+	    i_error("antispam_trained_cache_ttl must be a number of seconds");
+
+	tmp = config(user, "trained_cache_size");
+	if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &slots) < 0 || slots == 0))
+	{
+	    i_error("antispam_trained_cache_size must be a positive number");
+	    slots = ANTISPAM_TRAINED_CACHE_SLOTS;
+	}
+
+	asu->trained_cache = mmap_table_open(path, slots);
+    }
+
+    tmp = config(user, "trained_ledger");
+    if (!EMPTY_STR(tmp))
+    {
+	const char *path = tmp;
+	unsigned int slots = ANTISPAM_LEDGER_SLOTS;
+
+	tmp = config(user, "trained_ledger_size");
+	if (!EMPTY_STR(tmp) && (str_to_uint(tmp, &slots) < 0 || slots == 0))
+	{
+	    i_error("antispam_trained_ledger_size must be a positive number");
+	    slots = ANTISPAM_LEDGER_SLOTS;
+	}
+
+	asu->ledger = mmap_table_open(path, slots);
     }
 
+    user->v.deinit = antispam_user_deinit;
     MODULE_CONTEXT_SET(user, antispam_user_module, asu);
     return;
 
+bailout_deinit:
+    // the backend may hold files or connections open already
+    if (asu->backend->deinit != NULL)
+	asu->backend->deinit(user, asu->backend_config);
 bailout:
     p_free(user->pool, asu);
 }
@@ -6,49 +6,55 @@
 
 #include "aux.h"
 #include "backends.h"
+#include "batch.h"
+#include "folder-match.h"
+#include "mmap-table.h"
 
 extern MODULE_CONTEXT_DEFINE(antispam_user_module, &mail_user_module_register);
 #define USER_CONTEXT(obj) MODULE_CONTEXT(obj, antispam_user_module)
 
-enum match_type
-{
-    MT_EXACT,
-    MT_PATTERN,
-    MT_PATTERN_IGNORE_CASE,
-
-    /* should always be the last one */
-    NUM_MT
-};
-
-typedef bool(*match_fn_t) (const char *box_name, const char *query_name);
-
 static const struct
 {
     const char *human;
     const char *suffix;
-    match_fn_t fn;
-} match_info[NUM_MT] =
+    enum folder_match_type type;
+} match_info[] =
 {
-    [MT_EXACT] =
     {
 	.human = "exact match",
 	.suffix = "",
-	.fn = match_exact
+	.type = FMT_EXACT
     },
-    [MT_PATTERN] =
     {
 	.human = "wildcard match",
 	.suffix = "_pattern",
-	.fn = match_pattern
+	.type = FMT_PATTERN
     },
-    [MT_PATTERN_IGNORE_CASE] =
     {
 	.human = "case-insensitive wildcard match",
 	.suffix = "_pattern_ignorecase",
-	.fn = match_ipattern
+	.type = FMT_PATTERN_IGNORE_CASE
     }
 };
 
+struct antispam_stats
+{
+    // transactions on hooked mailboxes
+    unsigned int transactions;
+    // ... of which needed a backend transaction
+    unsigned int backend_transactions;
+    // training events dropped as duplicates or cancelled by opposite ones
+    unsigned int coalesced_events;
+    // signature-log dict connections opened, and transactions reusing one
+    unsigned int dict_connects;
+    unsigned int dict_reuses;
+    // signatures found in and missing from the trained cache
+    unsigned int trained_cache_hits;
+    unsigned int trained_cache_misses;
+    // copies not trained as the ledger had them trained already
+    unsigned int ledger_skips;
+};
+
 struct antispam_user
 {
     union mail_user_module_context module_ctx;
@@ -56,14 +62,35 @@ struct antispam_user
     // global config vars
     bool allow_append_to_spam;
     bool skip_from_line;
+    unsigned int exec_concurrency;
+    bool spawn_helper;
+    unsigned int train_delay;	// seconds, 0 to train at commit
+    bool batch_commands;	// one backend transaction per IMAP command
+    unsigned int batch_max_mails;
 
-    char **folders_spam[NUM_MT];
-    char **folders_trash[NUM_MT];
-    char **folders_unsure[NUM_MT];
+    struct folder_matcher *folders;
+    // mailbox name -> enum mailbox_class, see antispam_mailbox_classify()
+    struct strmap *box_classes;
+    // bit mask of the classes whose mailboxes need the copy/save hooks
+    unsigned int hooked_classes;
 
     // backend config vars pointer
     struct antispam_backend *backend;
     void *backend_config;
+    // headers the backend reads, NULL if it reads whole mails
+    const char *const *wanted_headers;
+
+    // host-wide table of the signatures trained lately, see
+    // signature_trained()
+    struct mmap_table *trained_cache;
+    unsigned int trained_cache_ttl;
+
+    // mail GUID -> class it was last trained as, see antispam_copy(); a
+    // best-effort cache, full tables forget their oldest entries
+    struct mmap_table *ledger;
+
+    struct antispam_batch batch;
+    struct antispam_stats stats;
 };
 
 void antispam_user_created(struct mail_user *user);
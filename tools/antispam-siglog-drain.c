@@ -0,0 +1,141 @@
+/*
+ * Drains the signature counters of a user written by the signature-log
+ * backend with antispam_siglog_generations set, for a trainer to read:
+ * moves the writers on to a new generation, gives the ones still writing
+ * to the old one a moment to commit and then prints the counters of the
+ * old generations as "<key>\t<value>" lines while taking them off.
+ *
+ * With -s it reads the shared counters of antispam_siglog_shards instead,
+ * summing up the given number of shards, and prints the given keys or all
+ * the md5 ones the same way. Nothing is taken off then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+#include "lib.h"
+#include "ioloop.h"
+#include "dict.h"
+
+#include "signature-log-trainer.h"
+
+#define DEFAULT_BASE_DIR "/var/run/dovecot"
+#define DEFAULT_BATCH_SIZE 100
+#define DEFAULT_WAIT_SECS 5
+
+static void drain_callback(const char *key, long long value,
+	void *context ATTR_UNUSED)
+{
+    printf("%s\t%lld\n", key, value);
+}
+
+static void ATTR_NORETURN usage(void)
+{
+    fprintf(stderr, "usage: antispam-siglog-drain [-b <batch size>] "
+	    "[-d <base_dir>] [-w <seconds>] <dict uri> <user>\n"
+	    "       antispam-siglog-drain [-d <base_dir>] -s <shards> "
+	    "<dict uri> <user> [<key> ...]\n");
+    exit(EX_USAGE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ioloop *ioloop;
+    struct dict *dict;
+    const char *base_dir = DEFAULT_BASE_DIR;
+    unsigned int batch_size = DEFAULT_BATCH_SIZE;
+    unsigned int wait_secs = DEFAULT_WAIT_SECS;
+    unsigned int shards = 0, frozen;
+    long long value;
+    int c, i, ret;
+
+    lib_init();
+
+    while ((c = getopt(argc, argv, "b:d:s:w:")) > 0)
+    {
+	switch (c)
+	{
+	    case 'b':
+		if (str_to_uint(optarg, &batch_size) < 0 || batch_size == 0)
+		    usage();
+		break;
+	    case 'd':
+		base_dir = optarg;
+		break;
+	    case 's':
+		if (str_to_uint(optarg, &shards) < 0 || shards == 0)
+		    usage();
+		break;
+	    case 'w':
+		if (str_to_uint(optarg, &wait_secs) < 0)
+		    usage();
+		break;
+	    default:
+		usage();
+	}
+    }
+
+    if (argc - optind < 2 || (shards == 0 && argc - optind != 2))
+	usage();
+
+    ioloop = io_loop_create();
+    dict_drivers_register_builtin();
+
+#if defined(DOVECOT_PREREQ) && DOVECOT_PREREQ(2,2)
+    {
+	const char *error;
+
+	if (dict_init(argv[optind], DICT_DATA_TYPE_STRING, argv[optind + 1],
+		    base_dir, &dict, &error) < 0)
+	    i_fatal("dict_init(%s) failed: %s", argv[optind], error);
+    }
+#else
+    dict = dict_init(argv[optind], DICT_DATA_TYPE_STRING, argv[optind + 1],
+	    base_dir);
+    if (dict == NULL)
+	i_fatal("dict_init(%s) failed", argv[optind]);
+#endif
+
+    if (shards > 0 && argc - optind == 2)
+    {
+	ret = signature_log_shared_iterate(dict, shards, drain_callback,
+		NULL);
+	if (ret < 0)
+	    i_error("failed to iterate the shared counters");
+    }
+    else if (shards > 0)
+    {
+	for (i = optind + 2, ret = 0; i < argc && ret >= 0; i++)
+	{
+	    ret = signature_log_shared_lookup(dict, argv[i], shards, &value);
+	    if (ret < 0)
+		i_error("failed to look up %s", argv[i]);
+	    else if (ret > 0)
+		drain_callback(argv[i], value, NULL);
+	}
+    }
+    else if ((ret = signature_log_generation_advance(dict, &frozen)) < 0)
+	i_error("failed to advance the signature generation");
+    else
+    {
+	// the writers that looked the generation up before it was advanced
+	sleep(wait_secs);
+
+	ret = signature_log_generation_drain(dict, frozen, batch_size,
+		drain_callback, NULL);
+	if (ret < 0)
+	    i_error("failed to drain signature generation %u", frozen);
+    }
+
+    if (fflush(stdout) != 0)
+	ret = -1;
+
+    dict_deinit(&dict);
+    dict_drivers_unregister_builtin();
+    io_loop_destroy(&ioloop);
+    lib_deinit();
+
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}